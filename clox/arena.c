@@ -0,0 +1,134 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGNMENT 16
+#define ALIGN(size) (((size) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+// sizeof(ArenaBlock) is already a multiple of ARENA_ALIGNMENT, data starts right after the header.
+#define BLOCK_DATA(block) ((char*)(block) + sizeof(ArenaBlock))
+#define DATA_BLOCK(data) ((ArenaBlock*)((char*)(data) - sizeof(ArenaBlock)))
+
+void InitArena(Arena* arena, void (*outOfMemory)(void* context), void* outOfMemoryContext)
+{
+	arena->blocks = NULL;
+	arena->large = NULL;
+	arena->next = NULL;
+	arena->end = NULL;
+	arena->outOfMemory = outOfMemory;
+	arena->outOfMemoryContext = outOfMemoryContext;
+}
+
+static void OutOfMemory(Arena* arena)
+{
+	arena->outOfMemory(arena->outOfMemoryContext);
+	abort(); // the handler broke its contract
+}
+
+static void* AllocateLarge(Arena* arena, size_t size)
+{
+	ArenaBlock* block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + size);
+	if (block == NULL) OutOfMemory(arena);
+
+	block->prev = NULL;
+	block->next = arena->large;
+	if (arena->large != NULL) arena->large->prev = block;
+	arena->large = block;
+	return BLOCK_DATA(block);
+}
+
+static void* ResizeLarge(Arena* arena, void* pointer, size_t newSize)
+{
+	ArenaBlock* block = (ArenaBlock*)realloc(DATA_BLOCK(pointer), sizeof(ArenaBlock) + newSize);
+	if (block == NULL) OutOfMemory(arena); // the old block is still linked in
+
+	if (block->prev != NULL) block->prev->next = block;
+	else arena->large = block;
+	if (block->next != NULL) block->next->prev = block;
+	return BLOCK_DATA(block);
+}
+
+void* ArenaAllocate(Arena* arena, size_t size)
+{
+	if (size > ARENA_LARGE_SIZE) return AllocateLarge(arena, size);
+
+	size = ALIGN(size);
+	if ((size_t)(arena->end - arena->next) < size)
+	{
+		ArenaBlock* block = (ArenaBlock*)malloc(ARENA_BLOCK_SIZE);
+		if (block == NULL) OutOfMemory(arena);
+
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->next = BLOCK_DATA(block);
+		arena->end = (char*)block + ARENA_BLOCK_SIZE;
+	}
+
+	void* result = arena->next;
+	arena->next += size;
+	return result;
+}
+
+void* ArenaGrow(Arena* arena, void* pointer, size_t oldSize, size_t newSize)
+{
+	if (pointer == NULL) return ArenaAllocate(arena, newSize);
+	if (newSize <= oldSize) return pointer;
+	if (oldSize > ARENA_LARGE_SIZE) return ResizeLarge(arena, pointer, newSize);
+
+	if ((char*)pointer + ALIGN(oldSize) == arena->next && newSize <= ARENA_LARGE_SIZE &&
+		(size_t)(arena->end - (char*)pointer) >= ALIGN(newSize))
+	{
+		arena->next = (char*)pointer + ALIGN(newSize);
+		return pointer;
+	}
+
+	void* result = ArenaAllocate(arena, newSize);
+	memcpy(result, pointer, oldSize);
+	return result;
+}
+
+static void FreeBlocks(ArenaBlock* block)
+{
+	while (block != NULL)
+	{
+		ArenaBlock* next = block->next;
+		free(block);
+		block = next;
+	}
+}
+
+ArenaMark ArenaSave(Arena* arena)
+{
+	ArenaMark mark;
+	mark.block = arena->blocks;
+	mark.next = arena->next;
+	mark.large = arena->large;
+	return mark;
+}
+
+void ArenaRelease(Arena* arena, ArenaMark mark)
+{
+	while (arena->large != mark.large)
+	{
+		ArenaBlock* block = arena->large;
+		arena->large = block->next;
+		free(block);
+	}
+	if (arena->large != NULL) arena->large->prev = NULL;
+
+	while (arena->blocks != mark.block)
+	{
+		ArenaBlock* block = arena->blocks;
+		arena->blocks = block->next;
+		free(block);
+	}
+	arena->next = mark.next;
+	arena->end = mark.block != NULL ? (char*)mark.block + ARENA_BLOCK_SIZE : NULL;
+}
+
+void FreeArena(Arena* arena)
+{
+	FreeBlocks(arena->blocks);
+	FreeBlocks(arena->large);
+	InitArena(arena, arena->outOfMemory, arena->outOfMemoryContext);
+}
@@ -0,0 +1,54 @@
+#ifndef clox_arena_h
+#define clox_arena_h
+
+#include "common.h"
+
+typedef struct ArenaBlock
+{
+	struct ArenaBlock* next;
+	struct ArenaBlock* prev; // only kept up to date for large blocks
+} ArenaBlock;
+
+// Bump allocator for memory that is released all at once. Requests bigger than ARENA_LARGE_SIZE get a malloc
+// block of their own so growing them can use realloc instead of copying. Arena memory isn't counted in
+// vm->bytesAllocated and allocating it never starts a collection.
+#define ARENA_BLOCK_SIZE (16 * 1024)
+#define ARENA_LARGE_SIZE (ARENA_BLOCK_SIZE / 4)
+
+typedef struct
+{
+	ArenaBlock* blocks; // newest first, 'next' points into the newest one
+	ArenaBlock* large;
+	char* next;
+	char* end;
+	// Called when malloc fails, with 'outOfMemoryContext'. It must not return, callers can't take NULL. The 
+	// arena is still intact, FreeArena() frees everything it got so far.
+	void (*outOfMemory)(void* context);
+	void* outOfMemoryContext;
+} Arena;
+
+// Everything allocated after the mark was taken can be released on its own, see ArenaRelease().
+typedef struct
+{
+	ArenaBlock* block;
+	char* next;
+	ArenaBlock* large;
+} ArenaMark;
+
+#define ARENA_ALLOCATE(arena, type, count) \
+	(type*)ArenaAllocate(arena, sizeof(type) * (count))
+
+#define ARENA_GROW_ARRAY(arena, type, array, oldCount, newCount) \
+	(type*)ArenaGrow(arena, array, sizeof(type) * (oldCount), sizeof(type) * (newCount))
+
+void InitArena(Arena* arena, void (*outOfMemory)(void* context), void* outOfMemoryContext);
+void* ArenaAllocate(Arena* arena, size_t size);
+// Like reallocate(), but a block that moves is only given back when the arena is freed. The newest allocation
+// grows in place if the current block has room.
+void* ArenaGrow(Arena* arena, void* pointer, size_t oldSize, size_t newSize);
+ArenaMark ArenaSave(Arena* arena);
+// Frees everything allocated since 'mark'. Blocks allocated before it must not have been grown since.
+void ArenaRelease(Arena* arena, ArenaMark mark);
+void FreeArena(Arena* arena);
+
+#endif // !clox_arena_h
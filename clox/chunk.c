@@ -1,5 +1,13 @@
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
+
+#include <assert.h>
+#include <string.h>
+
+#define CHUNK_ALIGN_MIN_SIZE (16 * CACHE_LINE) // keeps the padding under 1/16th of the block
+#define VALUE_ALIGNMENT 8
+#define ALIGN_UP(size, alignment) (((size) + (alignment) - 1) & ~(size_t)((alignment) - 1))
 
 void InitChunk(Chunk* chunk)
 {
@@ -8,29 +16,71 @@ void InitChunk(Chunk* chunk)
 	chunk->code = NULL;
 	InitLineRunArray(&chunk->line_runs);
 	InitValueArray(&chunk->constants);
+	chunk->arena = NULL;
 }
 
-void FreeChunk(Chunk* chunk)
+// Size of the block FinishChunk() packs the arrays into, not counting the alignment padding.
+static size_t PackedSize(Chunk* chunk)
 {
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-	FreeLineRunArray(&chunk->line_runs);
-	FreeValueArray(&chunk->constants);
+	return ALIGN_UP((size_t)chunk->count, VALUE_ALIGNMENT) + sizeof(Value) * chunk->constants.count +
+		sizeof(LineRun) * chunk->line_runs.count;
+}
+
+void FreeChunk(VM* vm, Chunk* chunk)
+{
+	// Arena arrays go away with the arena.
+	if (chunk->arena == NULL && chunk->code != NULL)
+	{
+		uint8_t* block = chunk->code;
+		size_t size = PackedSize(chunk);
+		if (size >= CHUNK_ALIGN_MIN_SIZE)
+		{
+			block -= chunk->code[-1];
+			size += CACHE_LINE;
+		}
+		FREE_ARRAY(vm, uint8_t, block, size);
+		vm->memStats.chunkBytes -= size;
+	}
 	InitChunk(chunk);
 }
 
+// Chunks are only written while the compiler's arena holds their arrays, so growing them never starts a collection.
+static void* GrowChunkArray(Chunk* chunk, void* array, size_t oldSize, size_t newSize)
+{
+	assert(chunk->arena != NULL && "Finished chunks can't be written to.");
+	return ArenaGrow(chunk->arena, array, oldSize, newSize);
+}
+
 void WriteChunk(Chunk* chunk, uint8_t value, int line)
 {
 	if (chunk->count >= chunk->capacity)
 	{
 		int old_capacity = chunk->capacity;
 		chunk->capacity = GROW_CAPACITY(old_capacity);
-		chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
+		chunk->code = (uint8_t*)GrowChunkArray(chunk, chunk->code, old_capacity, chunk->capacity);
 	}
 
 	chunk->code[chunk->count] = value;
 	chunk->count++;
 
-	WriteLine(&chunk->line_runs, line);
+	// WriteLine() needs room for a new run.
+	LineRunArray* lines = &chunk->line_runs;
+	if (lines->count >= lines->capacity)
+	{
+		int old_capacity = lines->capacity;
+		lines->capacity = GROW_CAPACITY(old_capacity);
+		lines->runs = (LineRun*)GrowChunkArray(chunk, lines->runs, sizeof(LineRun) * old_capacity, 
+			sizeof(LineRun) * lines->capacity);
+	}
+	WriteLine(lines, line);
+}
+
+// Removes every instruction at index >= count. Constants are left alone since other code might refer to them.
+void TruncateChunk(Chunk* chunk, int count)
+{
+	assert(count <= chunk->count);
+	RemoveLines(&chunk->line_runs, chunk->count - count);
+	chunk->count = count;
 }
  
 void WriteIndexOp(Chunk* chunk, int index, int line, OpCode shortOp, OpCode longOp)
@@ -60,8 +110,60 @@ int WriteConstant(Chunk* chunk, Value value, int line)
 
 int AddConstant(Chunk* chunk, Value value)
 {
-	WriteValueArray(&chunk->constants, value);
-	return chunk->constants.count - 1;
+	ValueArray* constants = &chunk->constants;
+	if (constants->count >= constants->capacity)
+	{
+		int old_capacity = constants->capacity;
+		constants->capacity = GROW_CAPACITY(old_capacity);
+		constants->values = (Value*)GrowChunkArray(chunk, constants->values, sizeof(Value) * old_capacity, 
+			sizeof(Value) * constants->capacity);
+	}
+	constants->values[constants->count] = value;
+	return constants->count++;
+}
+
+/*
+	The code comes first, followed by the constants it loads, so a small function's hot data shares a cache line 
+	or two. The line runs, only read for error messages, go last. Blocks of CHUNK_ALIGN_MIN_SIZE bytes or more 
+	are padded so the code starts on a cache line. The chunk has no field for the block, FreeChunk() works out 
+	its size from the counts again and finds the start of a padded one through the byte before the code.
+*/
+void FinishChunk(VM* vm, Chunk* chunk)
+{
+	if (chunk->arena == NULL) return;
+
+	LineRunArray* lines = &chunk->line_runs;
+	ValueArray* constants = &chunk->constants;
+	size_t codeSize = ALIGN_UP((size_t)chunk->count, VALUE_ALIGNMENT);
+	size_t constantsSize = sizeof(Value) * constants->count;
+	size_t linesSize = sizeof(LineRun) * lines->count;
+	size_t size = PackedSize(chunk);
+	bool aligned = size >= CHUNK_ALIGN_MIN_SIZE;
+
+	// The chunk keeps pointing into the arena until everything is copied, so a collection started by the 
+	// allocation still finds the constants.
+	uint8_t* block = ALLOCATE(vm, uint8_t, aligned ? size + CACHE_LINE : size);
+	vm->memStats.chunkBytes += aligned ? size + CACHE_LINE : size;
+	uint8_t* code = block;
+	if (aligned)
+	{
+		// Moves forward by 1 to CACHE_LINE bytes, there's always room to record how far.
+		code = (uint8_t*)ALIGN_UP((uintptr_t)block + 1, CACHE_LINE);
+		code[-1] = (uint8_t)(code - block);
+	}
+	Value* values = (Value*)(code + codeSize);
+	LineRun* runs = (LineRun*)((uint8_t*)values + constantsSize);
+	memcpy(code, chunk->code, chunk->count);
+	if (constantsSize > 0) memcpy(values, constants->values, constantsSize);
+	memcpy(runs, lines->runs, linesSize);
+
+	chunk->code = code;
+	chunk->capacity = chunk->count;
+	constants->values = values;
+	constants->capacity = constants->count;
+	lines->runs = runs;
+	lines->capacity = lines->count;
+	chunk->arena = NULL;
 }
 
 int GetLine(Chunk* chunk, int instr_index)
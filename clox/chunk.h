@@ -1,6 +1,7 @@
 #ifndef clox_chunk_h
 #define clox_chunk_h
 
+#include "arena.h"
 #include "common.h"
 #include "lines.h"
 #include "value.h"
@@ -25,6 +26,7 @@ typedef enum
 	OP_SUB,
 	OP_MULT,
 	OP_DIV,
+	OP_ADD_N, // followed by the number of operands, always 3 or more. 'a + b + c' in a single instruction.
 	OP_PRINT,
 	OP_POP,
 	OP_POPN,
@@ -38,12 +40,42 @@ typedef enum
 	OP_GET_LOCAL_LONG,
 	OP_SET_LOCAL,
 	OP_SET_LOCAL_LONG,
+	// In-place arithmetic on variables. These only take a one byte index, variables with bigger indices 
+	// fall back to get/op/set.
+	OP_ADD_LOCAL,
+	OP_SUB_LOCAL,
+	OP_MULT_LOCAL,
+	OP_DIV_LOCAL,
+	OP_INCREMENT_LOCAL, // followed by slot and a signed byte to add to the local
+	OP_ADD_GLOBAL,
+	OP_SUB_GLOBAL,
+	OP_MULT_GLOBAL,
+	OP_DIV_GLOBAL,
+	OP_INCREMENT_GLOBAL,
 	OP_JUMP,
 	OP_JUMP_IF_FALSE,
 	OP_JUMP_IF_TRUE,
 	OP_JUMP_BACK,
+	OP_JUMP_BACK_IF_TRUE, // pops the condition, unlike the other conditional jumps
 	OP_CALL,
 	OP_RETURN,
+	// Unchecked versions of the instructions above. Only emitted by SpecializeNumberOps() when every operand
+	// is known to be a number.
+	OP_NEGATE_NUMBER,
+	OP_GREATER_NUMBER,
+	OP_GREATER_EQUAL_NUMBER,
+	OP_LESS_NUMBER,
+	OP_LESS_EQUAL_NUMBER,
+	OP_ADD_NUMBER,
+	OP_SUB_NUMBER,
+	OP_MULT_NUMBER,
+	OP_DIV_NUMBER,
+	OP_ADD_N_NUMBER,
+	OP_ADD_LOCAL_NUMBER,
+	OP_SUB_LOCAL_NUMBER,
+	OP_MULT_LOCAL_NUMBER,
+	OP_DIV_LOCAL_NUMBER,
+	OP_INCREMENT_LOCAL_NUMBER,
 } OpCode;
 
 typedef struct
@@ -53,13 +85,19 @@ typedef struct
 	uint8_t* code;
 	LineRunArray line_runs;	
 	ValueArray constants;
+	// Set while the compiler writes the chunk, its arrays live in there. FinishChunk() then moves them into a 
+	// single block starting at 'code'.
+	Arena* arena;
 } Chunk;
 
 void InitChunk(Chunk* chunk);
-void FreeChunk(Chunk* chunk);
+void FreeChunk(VM* vm, Chunk* chunk);
 void WriteChunk(Chunk* chunk, uint8_t value, int line);
+void TruncateChunk(Chunk* chunk, int count);
 int WriteConstant(Chunk* chunk, Value value, int line);
 int AddConstant(Chunk* chunk, Value value);
+// Packs the arrays into a single heap block of exactly the size they need.
+void FinishChunk(VM* vm, Chunk* chunk);
 int GetLine(Chunk* chunk, int instr_index);
 void WriteGlobalDeclaration(Chunk* chunk, int index, int line);
 void WriteIndexOp(Chunk* chunk, int index, int line, OpCode shortOp, OpCode longOp);
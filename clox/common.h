@@ -7,5 +7,26 @@
 
 //#define DEBUG_PRINT_CODE
 //#define DEBUG_TRACE_EXECUTION
+//#define DEBUG_STRESS_GC // collect on every allocation to shake out objects that aren't reachable from a root
+//#define DEBUG_LOG_GC
+#define SPECIALIZE_NUMBER_OPS
+//#define HASH_FNV1A // byte at a time FNV-1a string hashing instead of the seeded word at a time hash
+#define POOL_ALLOCATOR // small blocks come from per size class free lists instead of malloc, see memory.c
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CLOX_SSE2
+#endif
+
+// The object header keeps the next pointer in 48 bits, see struct Obj. Only on targets whose heap addresses fit,
+// Android tags heap pointers in the top byte.
+#if (defined(__x86_64__) || defined(_M_X64) || defined(__aarch64__) || defined(_M_ARM64)) && !defined(__ANDROID__)
+#define PACKED_OBJ_HEADER
+#endif
+
+#define CACHE_LINE 64
+
+// Everything that runs code or allocates takes the VM it works on, there is no global one. Declared here so the
+// lower level headers can name it without including vm.h.
+typedef struct VM VM;
 
 #endif
@@ -2,25 +2,23 @@
 
 #include "common.h"
 #include "memory.h"
+#include "number.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
+#include "vm.h"
 
-#ifdef DEBUG_PRINT_CORE
-#include "debug.h
-#endif // DEBUG_PRINT_CORE
+#ifdef DEBUG_PRINT_CODE
+#include "debug.h"
+#endif // DEBUG_PRINT_CODE
 
 #include <assert.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-typedef struct
-{
-	Token current;
-	Token previous;
-	bool hadError;
-	bool panicMode; // resynchronize if true (prevents cascading errors).
-} Parser;
+typedef struct Parser Parser;
 
 typedef enum
 {
@@ -37,7 +35,7 @@ typedef enum
 	PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
 
 typedef struct
 {
@@ -46,8 +44,6 @@ typedef struct
 	Precedence precedence;
 } ParseRule;
 
-Parser parser;
-
 typedef struct
 {
 	Token name;
@@ -56,6 +52,17 @@ typedef struct
 
 #define MAX_LOCALS 500 // random number over 255 so I have an excuse to add _LONG_ op codes for local variable ops 
 
+// const declarations don't take up a stack slot or a global. Their value is known at compile time and gets 
+// substituted wherever they're used.
+typedef struct
+{
+	Token name;
+	int depth;
+	Value value;
+} Constant;
+
+#define MAX_CONSTANTS 256
+
 typedef enum
 {
 	TYPE_FUNCTION,
@@ -71,50 +78,77 @@ typedef struct Compiler
 	Local locals[MAX_LOCALS]; // Too lazy to make a dynamic array of Locals
 	int localsCount;
 	int currentScopeDepth;
+
+	Constant constants[MAX_CONSTANTS];
+	int constantsCount;
+
+	ArenaMark arenaMark; // the function's scratch memory starts here
 } Compiler;
 
-Compiler* currentCompiler;
+typedef struct
+{
+	// Loops are compiled in rotated form so the continue target (increment/condition) comes after the body.
+	// Continue statements therefore emit forward jumps which get patched once the target is known.
+	int* continueJumps;
+	int continueJumpsCount;
+	int continueJumpsCap;
+	int bodyScopeDepth;
+} LoopData;
+
+// Everything one Compile() call works on. Nothing is global, so separate VMs can compile at the same time.
+struct Parser
+{
+	VM* vm;
+	Scanner scanner;
+	Token current;
+	Token previous;
+	bool hadError;
+	bool panicMode; // resynchronize if true (prevents cascading errors).
+	Compiler* compiler; // innermost function being compiled
+	LoopData* loopData; // NULL when not compiling a loop body
+
+	// Everything the compiler needs only while it runs: the chunks being written, jump lists and the optimizer's 
+	// scratch arrays. Compile() frees all of it at once when it returns.
+	Arena arena;
+	jmp_buf outOfMemory; // Compile() returns from here once the arena can't get more memory
+};
 
-static void InitCompiler(Compiler* compiler, FunctionType type)
+static void InitCompiler(Parser* parser, Compiler* compiler, FunctionType type)
 {
-	compiler->enclosing = currentCompiler;
+	compiler->enclosing = parser->compiler;
 	compiler->function = NULL;
 	compiler->type = type;
 	compiler->localsCount = compiler->currentScopeDepth = 0;
-	compiler->function = NewFunction();
-	currentCompiler = compiler;
+	compiler->constantsCount = 0;
+	compiler->arenaMark = ArenaSave(&parser->arena);
+	compiler->function = NewFunction(parser->vm);
+	compiler->function->chunk.arena = &parser->arena;
+	parser->compiler = compiler;
 
 	if (type != TYPE_SCRIPT)
 	{
-		currentCompiler->function->name = CopyString(parser.previous.start, parser.previous.length);
+		ObjString* name = CopyString(parser->vm, parser->previous.start, parser->previous.length);
+		parser->compiler->function->name = name;
+		WriteBarrier(parser->vm, (Obj*)parser->compiler->function, OBJ_VAL(name));
 	}
 
 	// Compiler reserves stack slot 0 for itself. This slot is used to store the function
 	// being called.
-	Local* local = &currentCompiler->locals[currentCompiler->localsCount++];
+	Local* local = &parser->compiler->locals[parser->compiler->localsCount++];
 	local->depth = 0;
 	local->name.start = "";
 	local->name.length = 0;
 }
 
-static Chunk* CurrentChunk()
+static Chunk* CurrentChunk(Parser* parser)
 {
-	return &currentCompiler->function->chunk;
+	return &parser->compiler->function->chunk;
 }
 
-typedef struct
+static void ErrorAt(Parser* parser, Token* token, const char* message)
 {
-	int startInstructionIndex;
-	int endInstructionIndex;
-	int bodyScopeDepth;
-} LoopData;
-
-LoopData* currentLoopData;
-
-static void ErrorAt(Token* token, const char* message)
-{
-	if (parser.panicMode) { return; }
-	parser.panicMode = true;
+	if (parser->panicMode) { return; }
+	parser->panicMode = true;
 
 	fprintf(stderr, "[line %d] Error", token->line);
 
@@ -128,143 +162,180 @@ static void ErrorAt(Token* token, const char* message)
 	}
 
 	fprintf(stderr, ": %s\n", message);
-	parser.hadError = true;
+	parser->hadError = true;
 }
 
-static void ErrorAtCurrent(const char* message)
+static void ErrorAtCurrent(Parser* parser, const char* message)
 {
-	ErrorAt(&parser.current, message);
+	ErrorAt(parser, &parser->current, message);
 }
 
-static void Error(const char* message)
+static void Error(Parser* parser, const char* message)
 {
-	ErrorAt(&parser.previous, message);
+	ErrorAt(parser, &parser->previous, message);
 }
 
-static void Advance()
+static void Advance(Parser* parser)
 {
-	parser.previous = parser.current;
+	parser->previous = parser->current;
 
 	while (true)
 	{
-		parser.current = ScanToken();
-		if (parser.current.type != TOKEN_ERROR) { break; }
-		ErrorAtCurrent(parser.current.start);
+		parser->current = ScanToken(&parser->scanner);
+		if (parser->current.type != TOKEN_ERROR) { break; }
+		ErrorAtCurrent(parser, parser->current.start);
 	}
 }
 
-static void Consume(TokenType type, const char* message)
+static void Consume(Parser* parser, TokenType type, const char* message)
 {
-	if (parser.current.type == type)
+	if (parser->current.type == type)
 	{
-		Advance();
+		Advance(parser);
 	}
 	else
 	{
-		ErrorAtCurrent(message);
+		ErrorAtCurrent(parser, message);
 	}
 }
 
-static bool Check(TokenType type)
+static bool Check(Parser* parser, TokenType type)
 {
-	return parser.current.type == type;
+	return parser->current.type == type;
 }
 
-static bool Match(TokenType type)
+static bool Match(Parser* parser, TokenType type)
 {
-	if (Check(type)) {
-		Advance();
+	if (Check(parser, type)) {
+		Advance(parser);
 		return true;
 	}
 	return false;
 }
 
-static void EmitByte(uint8_t byte)
+static void EmitByte(Parser* parser, uint8_t byte)
 {
-	WriteChunk(CurrentChunk(), byte, parser.previous.line);
+	WriteChunk(CurrentChunk(parser), byte, parser->previous.line);
 }
 
-static int EmitConstant(Value value)
+// The function being compiled may already be old. Adding the constant can start a collection, so the barrier 
+// comes first, which is fine since remembering only asks for a rescan.
+static int EmitConstant(Parser* parser, Value value)
 {
-	return WriteConstant(CurrentChunk(), value, parser.previous.line);
+	WriteBarrier(parser->vm, (Obj*)parser->compiler->function, value);
+	return WriteConstant(CurrentChunk(parser), value, parser->previous.line);
 }
 
-static void Number(bool canAssign)
+static void Number(Parser* parser, bool canAssign)
 {
-	double value = strtod(parser.previous.start, NULL);
-	EmitConstant(NUMBER_VAL(value));
+	double value = ParseNumber(parser->previous.start, parser->previous.length);
+	EmitConstant(parser, NUMBER_VAL(value));
 }
 
-static void Expression();
-static void Statement();
-static void Declaration();
+static void Expression(Parser* parser);
+static void Statement(Parser* parser);
+static void Declaration(Parser* parser);
 static ParseRule* GetRule(TokenType type);
-static void ParsePrecedence(Precedence);
-static void And(bool);
-static void Or(bool);
-static void VarDeclaration();
-static void AddLocal(Token* name);
+static void ParsePrecedence(Parser* parser, Precedence);
+static void And(Parser* parser, bool);
+static void Or(Parser* parser, bool);
+static void VarDeclaration(Parser* parser);
+static void AddLocal(Parser* parser, Token* name);
 
-static void Grouping(bool canAssign)
+static void Grouping(Parser* parser, bool canAssign)
 {
-	Expression();
-	Consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+	Expression(parser);
+	Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void Unary(bool canAssign)
+static void Unary(Parser* parser, bool canAssign)
 {
-	TokenType opType = parser.previous.type;
+	TokenType opType = parser->previous.type;
 
-	ParsePrecedence(PREC_UNARY);
+	ParsePrecedence(parser, PREC_UNARY);
 
 	switch (opType)
 	{
-	case TOKEN_MINUS: EmitByte(OP_NEGATE); break;
-	case TOKEN_BANG: EmitByte(OP_NOT); break;
+	case TOKEN_MINUS: EmitByte(parser, OP_NEGATE); break;
+	case TOKEN_BANG: EmitByte(parser, OP_NOT); break;
 	default:
 		break;
 	}
 }
 
-static void Binary(bool canAssign)
+// Compiles the rest of 'a + b + c ...' into one OP_ADD_N, so joining strings builds the result once instead of 
+// making a throwaway string for each '+'.
+static void AddChain(Parser* parser)
 {
-	TokenType opType = parser.previous.type;
+	int operands = 2;
+	ParsePrecedence(parser, PREC_TERM + 1);
+	while (Match(parser, TOKEN_PLUS))
+	{
+		if (operands == UINT8_MAX)
+		{
+			EmitByte(parser, OP_ADD_N);
+			EmitByte(parser, operands);
+			operands = 1;
+		}
+		ParsePrecedence(parser, PREC_TERM + 1);
+		operands++;
+	}
+
+	if (operands == 2)
+	{
+		EmitByte(parser, OP_ADD);
+	}
+	else
+	{
+		EmitByte(parser, OP_ADD_N);
+		EmitByte(parser, operands);
+	}
+}
+
+static void Binary(Parser* parser, bool canAssign)
+{
+	TokenType opType = parser->previous.type;
+	if (opType == TOKEN_PLUS)
+	{
+		AddChain(parser);
+		return;
+	}
 
 	ParseRule* rule = GetRule(opType);
-	ParsePrecedence(rule->precedence + 1);
+	ParsePrecedence(parser, rule->precedence + 1);
 
 	switch (opType)
 	{
-	case TOKEN_PLUS: EmitByte(OP_ADD); break;
-	case TOKEN_MINUS: EmitByte(OP_SUB); break;
-	case TOKEN_STAR: EmitByte(OP_MULT); break;
-	case TOKEN_SLASH: EmitByte(OP_MULT); break;
-	case TOKEN_EQUAL_EQUAL: EmitByte(OP_EQUAL); break;
-	case TOKEN_BANG_EQUAL: EmitByte(OP_NOT_EQUAL); break;
-	case TOKEN_GREATER: EmitByte(OP_GREATER); break;
-	case TOKEN_GREATER_EQUAL: EmitByte(OP_GREATER_EQUAL); break;
-	case TOKEN_LESS: EmitByte(OP_LESS); break;
-	case TOKEN_LESS_EQUAL: EmitByte(OP_LESS_EQUAL); break;
+	case TOKEN_PLUS: EmitByte(parser, OP_ADD); break;
+	case TOKEN_MINUS: EmitByte(parser, OP_SUB); break;
+	case TOKEN_STAR: EmitByte(parser, OP_MULT); break;
+	case TOKEN_SLASH: EmitByte(parser, OP_DIV); break;
+	case TOKEN_EQUAL_EQUAL: EmitByte(parser, OP_EQUAL); break;
+	case TOKEN_BANG_EQUAL: EmitByte(parser, OP_NOT_EQUAL); break;
+	case TOKEN_GREATER: EmitByte(parser, OP_GREATER); break;
+	case TOKEN_GREATER_EQUAL: EmitByte(parser, OP_GREATER_EQUAL); break;
+	case TOKEN_LESS: EmitByte(parser, OP_LESS); break;
+	case TOKEN_LESS_EQUAL: EmitByte(parser, OP_LESS_EQUAL); break;
 	default:
 		return; // unreachable
 	}
 }
 
-static void Literal(bool canAssign)
+static void Literal(Parser* parser, bool canAssign)
 {
-	switch (parser.previous.type)
+	switch (parser->previous.type)
 	{
-	case TOKEN_NIL: EmitByte(OP_NIL); break;
-	case TOKEN_TRUE: EmitByte(OP_TRUE); break;
-	case TOKEN_FALSE: EmitByte(OP_FALSE); break;
+	case TOKEN_NIL: EmitByte(parser, OP_NIL); break;
+	case TOKEN_TRUE: EmitByte(parser, OP_TRUE); break;
+	case TOKEN_FALSE: EmitByte(parser, OP_FALSE); break;
 	default:
 		return; // unreachable
 	}
 }
 
-static void String(bool canAssign)
+static void String(Parser* parser, bool canAssign)
 {
-	EmitConstant(OBJ_VAL(CopyString(parser.previous.start, parser.previous.length)));
+	EmitConstant(parser, OBJ_VAL(CopyString(parser->vm, parser->previous.start, parser->previous.length)));
 }
 
 static bool IdentifiersEqual(Token* a, Token* b)
@@ -272,16 +343,16 @@ static bool IdentifiersEqual(Token* a, Token* b)
 	return a->length == b->length && memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int ResolveLocal(Token* name)
+static int ResolveLocal(Parser* parser, Token* name)
 {
-	for (int i = currentCompiler->localsCount - 1; i >= 0; i--)
+	for (int i = parser->compiler->localsCount - 1; i >= 0; i--)
 	{
-		Local* local = &currentCompiler->locals[i];
+		Local* local = &parser->compiler->locals[i];
 		if (IdentifiersEqual(name, &local->name))
 		{
 			if (local->depth == -1)
 			{
-				Error("Can't use variable in it's own initializer.");
+				Error(parser, "Can't use variable in it's own initializer.");
 			}
 			else return i;
 		}
@@ -290,70 +361,182 @@ static int ResolveLocal(Token* name)
 	return -1;
 }
 
-static int IdentifierConstant(Token* identifier)
+// Finds the const declaration 'name' refers to. Constants of enclosing functions are visible too since they
+// don't live on the stack. Returns NULL if 'name' isn't a constant or is shadowed by the local 'localIndex'.
+static Constant* ResolveConstant(Parser* parser, Token* name, int localIndex)
 {
-	return AddConstant(CurrentChunk(), OBJ_VAL(CopyString(identifier->start, identifier->length)));
+	for (Compiler* compiler = parser->compiler; compiler != NULL; compiler = compiler->enclosing)
+	{
+		for (int i = compiler->constantsCount - 1; i >= 0; i--)
+		{
+			Constant* constant = &compiler->constants[i];
+			if (IdentifiersEqual(name, &constant->name))
+			{
+				if (compiler == parser->compiler && localIndex != -1 && 
+					parser->compiler->locals[localIndex].depth > constant->depth) 
+				{
+					return NULL;
+				}
+				return constant;
+			}
+		}
+
+		if (localIndex != -1) { return NULL; }
+	}
+
+	return NULL;
+}
+
+static void EmitConstantValue(Parser* parser, Value value)
+{
+	switch (value.type)
+	{
+	case VAL_NIL: EmitByte(parser, OP_NIL); break;
+	case VAL_BOOL: EmitByte(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE); break;
+	default: EmitConstant(parser, value); break;
+	}
+}
+
+static int IdentifierConstant(Parser* parser, Token* identifier)
+{
+	Value name = OBJ_VAL(CopyString(parser->vm, identifier->start, identifier->length));
+	WriteBarrier(parser->vm, (Obj*)parser->compiler->function, name);
+	return AddConstant(CurrentChunk(parser), name);
 }
 
-static void NamedVariable(Token name, bool canAssign)
+static OpCode CompoundBinaryOp(TokenType type)
 {
-	OpCode getOp, getOpLong, setOp, setOpLong;
-	int index = ResolveLocal(&name);
+	switch (type)
+	{
+	case TOKEN_PLUS_EQUAL: return OP_ADD;
+	case TOKEN_MINUS_EQUAL: return OP_SUB;
+	case TOKEN_STAR_EQUAL: return OP_MULT;
+	case TOKEN_SLASH_EQUAL: return OP_DIV;
+	default:
+		return OP_ADD; // unreachable
+	}
+}
+
+static bool MatchCompoundAssignment(Parser* parser)
+{
+	return Match(parser, TOKEN_PLUS_EQUAL) || Match(parser, TOKEN_MINUS_EQUAL) || Match(parser, TOKEN_STAR_EQUAL) || Match(parser, TOKEN_SLASH_EQUAL);
+}
+
+static void NamedVariable(Parser* parser, Token name, bool canAssign)
+{
+	OpCode getOp, getOpLong, setOp, setOpLong, inPlaceAddOp, incrementOp;
+	int index = ResolveLocal(parser, &name);
+	Constant* constant = ResolveConstant(parser, &name, index);
+	if (constant != NULL)
+	{
+		if ((canAssign && (Check(parser, TOKEN_EQUAL) || Check(parser, TOKEN_PLUS_EQUAL) || Check(parser, TOKEN_MINUS_EQUAL) || 
+			Check(parser, TOKEN_STAR_EQUAL) || Check(parser, TOKEN_SLASH_EQUAL))) || Check(parser, TOKEN_PLUS_PLUS) || Check(parser, TOKEN_MINUS_MINUS))
+		{
+			ErrorAtCurrent(parser, "Can't assign to a constant.");
+			return;
+		}
+		EmitConstantValue(parser, constant->value);
+		return;
+	}
+	
 	if (index != -1)
 	{
 		getOp = OP_GET_LOCAL;
 		getOpLong = OP_GET_LOCAL_LONG;
 		setOp = OP_SET_LOCAL;
 		setOpLong = OP_SET_LOCAL_LONG;
+		inPlaceAddOp = OP_ADD_LOCAL;
+		incrementOp = OP_INCREMENT_LOCAL;
 	}
 	else
 	{
-		index = IdentifierConstant(&name);
+		index = IdentifierConstant(parser, &name);
 		getOp = OP_GET_GLOBAL;
 		getOpLong = OP_GET_GLOBAL_LONG;
 		setOp = OP_SET_GLOBAL;
 		setOpLong = OP_SET_GLOBAL_LONG;
+		inPlaceAddOp = OP_ADD_GLOBAL;
+		incrementOp = OP_INCREMENT_GLOBAL;
 	}
-	if (canAssign && Match(TOKEN_EQUAL))
+	if (canAssign && Match(parser, TOKEN_EQUAL))
 	{
-		Expression();
-		WriteIndexOp(CurrentChunk(), index, name.line, setOp, setOpLong);
+		Expression(parser);
+		WriteIndexOp(CurrentChunk(parser), index, name.line, setOp, setOpLong);
 	}
-	else { WriteIndexOp(CurrentChunk(), index, name.line, getOp, getOpLong); }
+	else if (canAssign && MatchCompoundAssignment(parser))
+	{
+		// x op= y evaluates to the new value of x, just like x = x op y.
+		OpCode binaryOp = CompoundBinaryOp(parser->previous.type);
+		if (index <= UINT8_MAX)
+		{
+			Expression(parser);
+			// In-place ops are laid out in the same order as OP_ADD, OP_SUB, OP_MULT, OP_DIV.
+			EmitByte(parser, inPlaceAddOp + (binaryOp - OP_ADD));
+			EmitByte(parser, (uint8_t)index);
+		}
+		else
+		{
+			WriteIndexOp(CurrentChunk(parser), index, name.line, getOp, getOpLong);
+			Expression(parser);
+			EmitByte(parser, binaryOp);
+			WriteIndexOp(CurrentChunk(parser), index, name.line, setOp, setOpLong);
+		}
+	}
+	else if (Match(parser, TOKEN_PLUS_PLUS) || Match(parser, TOKEN_MINUS_MINUS))
+	{
+		// Postfix increment/decrement evaluates to the old value of x.
+		int8_t delta = parser->previous.type == TOKEN_PLUS_PLUS ? 1 : -1;
+		if (index <= UINT8_MAX)
+		{
+			EmitByte(parser, incrementOp);
+			EmitByte(parser, (uint8_t)index);
+			EmitByte(parser, (uint8_t)delta);
+		}
+		else
+		{
+			WriteIndexOp(CurrentChunk(parser), index, name.line, getOp, getOpLong);
+			WriteIndexOp(CurrentChunk(parser), index, name.line, getOp, getOpLong);
+			EmitConstant(parser, NUMBER_VAL(delta));
+			EmitByte(parser, OP_ADD);
+			WriteIndexOp(CurrentChunk(parser), index, name.line, setOp, setOpLong);
+			EmitByte(parser, OP_POP);
+		}
+	}
+	else { WriteIndexOp(CurrentChunk(parser), index, name.line, getOp, getOpLong); }
 }
 
-static void Variable(bool canAssign)
+static void Variable(Parser* parser, bool canAssign)
 {
-	NamedVariable(parser.previous, canAssign);
+	NamedVariable(parser, parser->previous, canAssign);
 }
 
-static int ArgumentList()
+static int ArgumentList(Parser* parser)
 {
 	int argsCount = 0;
 
-	if (!Check(TOKEN_RIGHT_PAREN))
+	if (!Check(parser, TOKEN_RIGHT_PAREN))
 	{
 		do
 		{
 			argsCount++;
 			if (argsCount >= 255)
 			{
-				ErrorAtCurrent("Too many arguments.");
+				ErrorAtCurrent(parser, "Too many arguments.");
 			}
-			Expression();
-		} while (Match(TOKEN_COMMA));
+			Expression(parser);
+		} while (Match(parser, TOKEN_COMMA));
 	}
 	
-	Consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+	Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
 
 	return argsCount;
 }
 
-static void Call(bool canAssign)
+static void Call(Parser* parser, bool canAssign)
 {
-	int argsCount = ArgumentList();
-	EmitByte(OP_CALL);
-	EmitByte((uint8_t)argsCount);
+	int argsCount = ArgumentList(parser);
+	EmitByte(parser, OP_CALL);
+	EmitByte(parser, (uint8_t)argsCount);
 }
 
 ParseRule rules[] = {
@@ -376,11 +559,18 @@ ParseRule rules[] = {
 	[TOKEN_GREATER_EQUAL] = {NULL,     Binary,   PREC_COMPARISON},
 	[TOKEN_LESS] = {NULL, Binary,   PREC_COMPARISON},
 	[TOKEN_LESS_EQUAL] = {NULL,     Binary,   PREC_COMPARISON},
+	[TOKEN_PLUS_EQUAL] = {NULL,     NULL,   PREC_NONE},
+	[TOKEN_MINUS_EQUAL] = {NULL,     NULL,   PREC_NONE},
+	[TOKEN_STAR_EQUAL] = {NULL,     NULL,   PREC_NONE},
+	[TOKEN_SLASH_EQUAL] = {NULL,     NULL,   PREC_NONE},
+	[TOKEN_PLUS_PLUS] = {NULL,     NULL,   PREC_NONE},
+	[TOKEN_MINUS_MINUS] = {NULL,     NULL,   PREC_NONE},
 	[TOKEN_IDENTIFIER] = {Variable,     NULL,   PREC_NONE},
 	[TOKEN_STRING] = {String,     NULL,   PREC_NONE},
 	[TOKEN_NUMBER] = {Number,   NULL,   PREC_NONE},
 	[TOKEN_AND] = {NULL,     And,   PREC_AND},
 	[TOKEN_CLASS] = {NULL,     NULL,   PREC_NONE},
+	[TOKEN_CONST] = {NULL,     NULL,   PREC_NONE},
 	[TOKEN_ELSE] = {NULL,     NULL,   PREC_NONE},
 	[TOKEN_FALSE] = {Literal,     NULL,   PREC_NONE},
 	[TOKEN_FOR] = {NULL,     NULL,   PREC_NONE},
@@ -405,310 +595,343 @@ ParseRule* GetRule(TokenType type)
 	return &rules[type];
 }
 
-static void ParsePrecedence(Precedence precedence)
+static void ParsePrecedence(Parser* parser, Precedence precedence)
 {
-	Advance();
+	Advance(parser);
 
-	ParseFn prefixRule = GetRule(parser.previous.type)->prefix;
+	ParseFn prefixRule = GetRule(parser->previous.type)->prefix;
 	if (prefixRule == NULL)
 	{
-		Error("Expect expression.");
+		Error(parser, "Expect expression.");
 		return;
 	}
 
 	bool canAssign = precedence <= PREC_ASSIGNMENT;
-	prefixRule(canAssign);
+	prefixRule(parser, canAssign);
 
-	while (precedence <= GetRule(parser.current.type)->precedence)
+	while (precedence <= GetRule(parser->current.type)->precedence)
 	{
-		Advance();
-		ParseFn infixRule = GetRule(parser.previous.type)->infix;
-		infixRule(canAssign);
+		Advance(parser);
+		ParseFn infixRule = GetRule(parser->previous.type)->infix;
+		infixRule(parser, canAssign);
 	}
 
-	if (canAssign && Match(TOKEN_EQUAL))
+	if (canAssign && (Match(parser, TOKEN_EQUAL) || MatchCompoundAssignment(parser)))
 	{
-		Error("Invalid assignment target.");
+		Error(parser, "Invalid assignment target.");
 	}
 }
 
-static ObjFunction* EndCompiler()
+static ObjFunction* EndCompiler(Parser* parser)
 {
 	// return NIL if there is no return value.
-	EmitByte(OP_NIL);
-	EmitByte(OP_RETURN);
-	ObjFunction* function = currentCompiler->function;
+	EmitByte(parser, OP_NIL);
+	EmitByte(parser, OP_RETURN);
+	ObjFunction* function = parser->compiler->function;
+#ifdef SPECIALIZE_NUMBER_OPS
+	if (!parser->hadError)
+	{
+		SpecializeNumberOps(function);
+	}
+#endif
 #ifdef DEBUG_PRINT_CODE
-	if (!parser.hadError)
+	if (!parser->hadError)
 	{
-		DisassembleChunk(CurrentChunk(), function->name != NULL ? function->name->chars : "<script>");
+		DisassembleChunk(parser->vm, CurrentChunk(parser), function->name != NULL ? function->name->chars : "<script>");
 	}
 #endif
-	currentCompiler = currentCompiler->enclosing;
+	// Nothing the enclosing function owns was allocated while this one was compiled, so everything after the mark
+	// can go.
+	FinishChunk(parser->vm, &function->chunk);
+	ArenaRelease(&parser->arena, parser->compiler->arenaMark);
+	parser->compiler = parser->compiler->enclosing;
 	return function;
 }
 
-static void Expression()
+static void Expression(Parser* parser)
 {
 	register int i = 0;
-	ParsePrecedence(PREC_ASSIGNMENT);
+	ParsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void PrintStatement()
+static void PrintStatement(Parser* parser)
 {
-	Expression();
-	Consume(TOKEN_SEMICOLON, "Expect ';' after print statement.");
-	EmitByte(OP_PRINT);
+	Expression(parser);
+	Consume(parser, TOKEN_SEMICOLON, "Expect ';' after print statement.");
+	EmitByte(parser, OP_PRINT);
 }
 
-static void ExpressionStatement()
+static void ExpressionStatement(Parser* parser)
 {
-	Expression();
-	Consume(TOKEN_SEMICOLON, "Expect ';' after expression statement.");
-	EmitByte(OP_POP);
+	Expression(parser);
+	Consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression statement.");
+	EmitByte(parser, OP_POP);
 }
 
-static void Block()
+static void Block(Parser* parser)
 {
-	while (!Check(TOKEN_RIGHT_BRACE) && !Check(TOKEN_EOF))
+	while (!Check(parser, TOKEN_RIGHT_BRACE) && !Check(parser, TOKEN_EOF))
 	{
-		Declaration();
+		Declaration(parser);
 	}
 
-	Consume(TOKEN_RIGHT_BRACE, "Expect '}' at end of block.");
+	Consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' at end of block.");
 }
 
-static void BeginScope()
+static void BeginScope(Parser* parser)
 {
-	currentCompiler->currentScopeDepth++;
+	parser->compiler->currentScopeDepth++;
 }
 
-static void EndScope()
+static void EndScope(Parser* parser)
 {
-	int scopeToClose = currentCompiler->currentScopeDepth--;
+	int scopeToClose = parser->compiler->currentScopeDepth--;
+	while (parser->compiler->constantsCount > 0 && 
+		parser->compiler->constants[parser->compiler->constantsCount - 1].depth == scopeToClose)
+	{
+		parser->compiler->constantsCount--;
+	}
+
 	int popCount = 0;
-	for (int i = currentCompiler->localsCount - 1; i >= 0; i--)
+	for (int i = parser->compiler->localsCount - 1; i >= 0; i--)
 	{
-		if (currentCompiler->locals[i].depth != scopeToClose) { break; }
+		if (parser->compiler->locals[i].depth != scopeToClose) { break; }
 		popCount++;
-		currentCompiler->localsCount--;
+		parser->compiler->localsCount--;
 	}
 
 	assert(popCount <= UINT8_MAX);
 	if (popCount > 0)
 	{
-		EmitByte(OP_POPN);
-		EmitByte((uint8_t)popCount);
+		EmitByte(parser, OP_POPN);
+		EmitByte(parser, (uint8_t)popCount);
 	}
 }
 
-static int EmitJump(OpCode op)
+static int EmitJump(Parser* parser, OpCode op)
 {
-	EmitByte(op);
-	EmitByte(0xFF);
-	EmitByte(0xFF);
-	EmitByte(0xFF);
-	return CurrentChunk()->count - 3;
+	EmitByte(parser, op);
+	EmitByte(parser, 0xFF);
+	EmitByte(parser, 0xFF);
+	EmitByte(parser, 0xFF);
+	return CurrentChunk(parser)->count - 3;
 }
 
-static void PatchJump(int jumpIndex)
+static void PatchJump(Parser* parser, int jumpIndex)
 {
-	int dest = CurrentChunk()->count;
+	int dest = CurrentChunk(parser)->count;
 	int offset = dest - jumpIndex - 3; // exclude the 3 bytes used to store offset
 
-	CurrentChunk()->code[jumpIndex] = offset & 0xFF;
-	CurrentChunk()->code[jumpIndex + 1] = (offset >> 8) & 0xFF;
-	CurrentChunk()->code[jumpIndex + 2] = (offset >> 16) & 0xFF;
+	CurrentChunk(parser)->code[jumpIndex] = offset & 0xFF;
+	CurrentChunk(parser)->code[jumpIndex + 1] = (offset >> 8) & 0xFF;
+	CurrentChunk(parser)->code[jumpIndex + 2] = (offset >> 16) & 0xFF;
 }
 
-static void IfStatement()
+static void IfStatement(Parser* parser)
 {
-	Consume(TOKEN_LEFT_PAREN, "Expect '(' before if condition.");
-	Expression();
-	Consume(TOKEN_RIGHT_PAREN, "Expect ')' after if condition.");
+	Consume(parser, TOKEN_LEFT_PAREN, "Expect '(' before if condition.");
+	Expression(parser);
+	Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after if condition.");
 
-	int falseJump = EmitJump(OP_JUMP_IF_FALSE);
+	int falseJump = EmitJump(parser, OP_JUMP_IF_FALSE);
 
-	EmitByte(OP_POP); // Pop condition expression for true case
-	Statement();
-	int trueJump = EmitJump(OP_JUMP);
+	EmitByte(parser, OP_POP); // Pop condition expression for true case
+	Statement(parser);
+	int trueJump = EmitJump(parser, OP_JUMP);
 
-	PatchJump(falseJump);
+	PatchJump(parser, falseJump);
 
-	EmitByte(OP_POP); // Pop condition expression for false case
+	EmitByte(parser, OP_POP); // Pop condition expression for false case
 
-	if (Match(TOKEN_ELSE))
+	if (Match(parser, TOKEN_ELSE))
 	{
-		Statement();
+		Statement(parser);
 	}
 
-	PatchJump(trueJump);
+	PatchJump(parser, trueJump);
 }
 
-static void EmitLoopJump(int jumpDestination)
+static void EmitLoopJump(Parser* parser, OpCode op, int jumpDestination)
 {
-	assert(jumpDestination < CurrentChunk()->count);
+	assert(jumpDestination <= CurrentChunk(parser)->count);
 
-	EmitByte(OP_JUMP_BACK);
+	EmitByte(parser, op);
 
-	int offset = CurrentChunk()->count - jumpDestination + 3; // include 3 bytes
-	EmitByte(offset & 0xFF);
-	EmitByte((offset >> 8) & 0xFF);
-	EmitByte((offset >> 16) & 0xFF);
+	int offset = CurrentChunk(parser)->count - jumpDestination + 3; // include 3 bytes
+	EmitByte(parser, offset & 0xFF);
+	EmitByte(parser, (offset >> 8) & 0xFF);
+	EmitByte(parser, (offset >> 16) & 0xFF);
 }
 
-static void And(bool canAssign)
+static void And(Parser* parser, bool canAssign)
 {
-	int falseJump = EmitJump(OP_JUMP_IF_FALSE);
+	int falseJump = EmitJump(parser, OP_JUMP_IF_FALSE);
 
-	EmitByte(OP_POP);
-	ParsePrecedence(PREC_AND);
+	EmitByte(parser, OP_POP);
+	ParsePrecedence(parser, PREC_AND);
 
-	PatchJump(falseJump);
+	PatchJump(parser, falseJump);
 }
 
-static void Or(bool canAssign)
+static void Or(Parser* parser, bool canAssign)
 {
-	int trueJump = EmitJump(OP_JUMP_IF_TRUE);
+	int trueJump = EmitJump(parser, OP_JUMP_IF_TRUE);
 
-	EmitByte(OP_POP);
-	ParsePrecedence(PREC_OR);
+	EmitByte(parser, OP_POP);
+	ParsePrecedence(parser, PREC_OR);
 
-	PatchJump(trueJump);
+	PatchJump(parser, trueJump);
 }
 
 
-static void WhileStatement()
+// Skips over the tokens of an expression without compiling it. Stops at 'terminator' when it isn't nested inside
+// parentheses. Returns the first token of the expression so it can be compiled later on with DeferredExpression().
+static Token SkipExpression(Parser* parser, TokenType terminator)
 {
-	Consume(TOKEN_LEFT_PAREN, "Expect '(' before while condition.");
+	Token start = parser->current;
+	int parenDepth = 0;
 
-	LoopData* enclosingLoopData = currentLoopData;
-	LoopData innerLoopData;
-	innerLoopData.startInstructionIndex = CurrentChunk()->count;
-	innerLoopData.endInstructionIndex = -1;
-	innerLoopData.bodyScopeDepth = currentCompiler->currentScopeDepth + 1;
-	currentLoopData = &innerLoopData;
+	while (!Check(parser, TOKEN_EOF))
+	{
+		if (parenDepth == 0 && Check(parser, terminator)) { break; }
+		if (Check(parser, TOKEN_LEFT_PAREN)) { parenDepth++; }
+		else if (Check(parser, TOKEN_RIGHT_PAREN)) { parenDepth--; }
+		Advance(parser);
+	}
 
-	Expression();
+	return start;
+}
 
-	Consume(TOKEN_RIGHT_PAREN, "Expect ')' after while condition.");
+// Compiles the expression previously skipped by SkipExpression() and then puts the parser back where it was.
+static void DeferredExpression(Parser* parser, Token* start)
+{
+	Token previous = parser->previous;
+	Token current = parser->current;
 
-	int falseJump = EmitJump(OP_JUMP_IF_FALSE);
-	EmitByte(OP_POP); // true case condition pop
-	Statement();
-	EmitLoopJump(innerLoopData.startInstructionIndex);
+	RewindScanner(&parser->scanner, start);
+	Advance(parser);
+	Expression(parser);
 
-	PatchJump(falseJump);
-	innerLoopData.endInstructionIndex = CurrentChunk()->count;
-	EmitByte(OP_POP); // false case condition pop
+	RewindScanner(&parser->scanner, &current);
+	Advance(parser);
+	parser->previous = previous;
+}
 
-	currentLoopData = enclosingLoopData;
+static void BeginLoop(LoopData* loopData, int bodyScopeDepth)
+{
+	loopData->continueJumps = NULL;
+	loopData->continueJumpsCount = loopData->continueJumpsCap = 0;
+	loopData->bodyScopeDepth = bodyScopeDepth;
+}
+
+// Patches continue statements in the loop body to jump to the current instruction.
+static void PatchContinueJumps(Parser* parser, LoopData* loopData)
+{
+	for (int i = 0; i < loopData->continueJumpsCount; i++)
+	{
+		PatchJump(parser, loopData->continueJumps[i]);
+	}
+
+	BeginLoop(loopData, loopData->bodyScopeDepth);
 }
 
 /*
-	It's not easy to generate the bytecode for increment and simply append it to the bytecode for the
-	for loop body so this ugly logic is somewhat necessary and simpler. The bytecode for the condition is
-	generated twice. The first time the condition bytecode is generated, it is followed by a jump instruction
-	which skips over the second condition bytecode and the increment bytecode, preventing the increment code
-	from running before the loop body.
-
-	1. condition_bytecode1
-	2. jump_if_false 9 // (here '9' is absolute index but in actual bytecode it's stored as offset aka 9-2 = 7 instead).
-	3. jump 7	// condition met the first time around, execute loop body and skip increment
-	4. condition_bytecode2
-	5. jump_if_false 9
-	6. increment_bytecode
-	7. while_loop_body
-	8. jump 4	// jump back to condition_bytecode2 and run increment code
-	9. ...
+	Loops are rotated so that the condition is checked at the bottom of the loop. This way every iteration
+	only executes a single (conditional) jump. The condition and increment are skipped over when they're first
+	parsed and compiled after the loop body by rescanning their tokens. OP_JUMP_BACK_IF_TRUE pops the condition.
+
+	1. initializer		// for loops only
+	2. jump 5
+	3. loop_body
+	4. increment_bytecode	// for loops only. Continue target
+	5. condition_bytecode
+	6. jump_back_if_true 3
+	7. ...
+
+	For loops without a condition, 2 is left out and 5/6 are replaced by an unconditional jump back to 3.
 */
-static void ForStatement()
+static void WhileStatement(Parser* parser)
+{
+	Consume(parser, TOKEN_LEFT_PAREN, "Expect '(' before while condition.");
+
+	LoopData* enclosingLoopData = parser->loopData;
+	LoopData innerLoopData;
+	BeginLoop(&innerLoopData, parser->compiler->currentScopeDepth + 1);
+	parser->loopData = &innerLoopData;
+
+	Token condition = SkipExpression(parser, TOKEN_RIGHT_PAREN);
+	Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after while condition.");
+
+	int conditionJump = EmitJump(parser, OP_JUMP);
+	int bodyStart = CurrentChunk(parser)->count;
+	Statement(parser);
+
+	PatchContinueJumps(parser, &innerLoopData);
+	PatchJump(parser, conditionJump);
+	DeferredExpression(parser, &condition);
+	EmitLoopJump(parser, OP_JUMP_BACK_IF_TRUE, bodyStart);
+
+	parser->loopData = enclosingLoopData;
+}
+
+static void ForStatement(Parser* parser)
 {
-	Consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+	Consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
 
-	LoopData* enclosingLoopData = currentLoopData;
+	LoopData* enclosingLoopData = parser->loopData;
 	LoopData innerLoopData;
-	innerLoopData.startInstructionIndex = -1;
-	innerLoopData.endInstructionIndex = -1;
-	innerLoopData.bodyScopeDepth = currentCompiler->currentScopeDepth + 1;
-	currentLoopData = &innerLoopData;
+	BeginLoop(&innerLoopData, parser->compiler->currentScopeDepth + 1);
 
 	bool hasInitializer = false;
-	if (!Match(TOKEN_SEMICOLON))
+	if (!Match(parser, TOKEN_SEMICOLON))
 	{
-		if (Match(TOKEN_VAR)) 
+		if (Match(parser, TOKEN_VAR)) 
 		{
 			hasInitializer = true;
-			BeginScope();
+			BeginScope(parser);
 			innerLoopData.bodyScopeDepth++; // body is one scope deeper since var decl is in it's own top level scope
-			VarDeclaration();
+			VarDeclaration(parser);
 		}
 		else {
-			/*Expression();
-			Consume(TOKEN_SEMICOLON, "Expect ';' after for loop initializer.");*/
-			ExpressionStatement();
+			ExpressionStatement(parser);
 		}
 	}
 
-	int preLoopFalseJump = -1;
-	int conditionBeginIndex = 0, conditionEndIndex = 0;
-	if (!Match(TOKEN_SEMICOLON))
-	{
-		conditionBeginIndex = CurrentChunk()->count;
-		// condition- note for self: NOT ExpressionStatement() b/c we want value of condition to remain on stack
-		Expression(); 
-		conditionEndIndex = CurrentChunk()->count;
-
-		Consume(TOKEN_SEMICOLON, "Expect ';' after for loop condition.");
+	parser->loopData = &innerLoopData;
 
-		preLoopFalseJump = EmitJump(OP_JUMP_IF_FALSE);
-		EmitByte(OP_POP);
-	}
+	bool hasCondition = !Check(parser, TOKEN_SEMICOLON);
+	Token condition = SkipExpression(parser, TOKEN_SEMICOLON);
+	Consume(parser, TOKEN_SEMICOLON, "Expect ';' after for loop condition.");
 
-	// This jump prevents the "increment" from running before the first iteration of the loop
-	int conditionAndIncrJump = EmitJump(OP_JUMP);
-	int loopJumpLocation = CurrentChunk()->count;
+	bool hasIncrement = !Check(parser, TOKEN_RIGHT_PAREN);
+	Token increment = SkipExpression(parser, TOKEN_RIGHT_PAREN);
+	Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' before for loop body.");
 
-	innerLoopData.startInstructionIndex = CurrentChunk()->count;
+	int conditionJump = hasCondition ? EmitJump(parser, OP_JUMP) : -1;
+	int bodyStart = CurrentChunk(parser)->count;
+	Statement(parser); // loop body
 
-	if (!Check(TOKEN_RIGHT_PAREN))
+	PatchContinueJumps(parser, &innerLoopData);
+	if (hasIncrement)
 	{
-		Expression(); // increment
-		EmitByte(OP_POP); // pop incr value
+		DeferredExpression(parser, &increment);
+		EmitByte(parser, OP_POP); // pop incr value
 	}
 
-	// Copy condition
-	for (int i = conditionBeginIndex; i < conditionEndIndex; i++)
+	if (hasCondition)
 	{
-		EmitByte(CurrentChunk()->code[i]);
+		PatchJump(parser, conditionJump);
+		DeferredExpression(parser, &condition);
+		EmitLoopJump(parser, OP_JUMP_BACK_IF_TRUE, bodyStart);
 	}
-
-	int postLoopFalseJump = -1;
-	if (conditionBeginIndex != conditionEndIndex) {
-		postLoopFalseJump = EmitJump(OP_JUMP_IF_FALSE);
-		EmitByte(OP_POP);
-	}
-
-	PatchJump(conditionAndIncrJump);
-
-	Consume(TOKEN_RIGHT_PAREN, "Expect ')' before for loop body.");
-
-	// EmitByte(OP_POP); // pop condition true case
-	Statement(); // loop body
-	EmitLoopJump(loopJumpLocation);
-
-	innerLoopData.endInstructionIndex = CurrentChunk()->count;
-	
-	if (preLoopFalseJump > -1)
+	else
 	{
-		PatchJump(preLoopFalseJump);
-		PatchJump(postLoopFalseJump);
-		EmitByte(OP_POP); // pop condition false case
+		EmitLoopJump(parser, OP_JUMP_BACK, bodyStart);
 	}
 
-	if (hasInitializer) { EndScope(); }
+	if (hasInitializer) { EndScope(parser); }
 
-	currentLoopData = enclosingLoopData;
+	parser->loopData = enclosingLoopData;
 }
 
 // We need value being switched on to stay on the stack. Solution: OP_EQUAL_SWITCH. This is similar to
@@ -720,30 +943,30 @@ static void ForStatement()
 // TODO change this so that switched on expression is treated as a local variable. I think this will make it 
 // much easier to support continue/break statements later on.
 
-static void SwitchStatement()
+static void SwitchStatement(Parser* parser)
 {
-	BeginScope();
+	BeginScope(parser);
 
-	Consume(TOKEN_LEFT_PAREN, "Expect '(' after switch.");
+	Consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after switch.");
 	
-	Expression(); // switch on
+	Expression(parser); // switch on
 
 	// Treat value being switched on as a variable so we can push it later on to compare with case values.
 	Token switchedOn;	// dummy token
 	switchedOn.length = -1;
 	switchedOn.start = NULL;
-	switchedOn.line = parser.previous.line;
-	AddLocal(&switchedOn);
-	int switchedOnIndex = currentCompiler->localsCount - 1;
+	switchedOn.line = parser->previous.line;
+	AddLocal(parser, &switchedOn);
+	int switchedOnIndex = parser->compiler->localsCount - 1;
 	// TODO ensure temp vars like this don't impact var lookup/ var definitions for normal vars
-	currentCompiler->locals[switchedOnIndex].depth = currentCompiler->currentScopeDepth;
+	parser->compiler->locals[switchedOnIndex].depth = parser->compiler->currentScopeDepth;
 
-	Consume(TOKEN_RIGHT_PAREN, "Expect ')' after switch.");
-	Consume(TOKEN_LEFT_BRACE, "Expect '{' before switch body.");
+	Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after switch.");
+	Consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before switch body.");
 
-	if (!Check(TOKEN_CASE))
+	if (!Check(parser, TOKEN_CASE))
 	{
-		Error("Switch statement must contain at least one case.");
+		Error(parser, "Switch statement must contain at least one case.");
 		return;
 	}
 
@@ -752,79 +975,77 @@ static void SwitchStatement()
 
 	int endJumpsCap = 8;
 	int* endJumps = NULL;
-	endJumps = GROW_ARRAY(int, endJumps, 0, endJumpsCap);
+	endJumps = ARENA_ALLOCATE(&parser->arena, int, endJumpsCap);
 	int endJumpsCount = 0;
 
 	int nextCaseJump = -1; // used when cnd not met
-	while (Match(TOKEN_CASE))
+	while (Match(parser, TOKEN_CASE))
 	{
 		if (nextCaseJump != -1)
 		{
-			PatchJump(nextCaseJump);
-			EmitByte(OP_POP); // false value from comparison with previous case value.
+			PatchJump(parser, nextCaseJump);
+			EmitByte(parser, OP_POP); // false value from comparison with previous case value.
 		}
-		Expression();
-		Consume(TOKEN_COLON, "Expect ':' before case body.");
+		Expression(parser);
+		Consume(parser, TOKEN_COLON, "Expect ':' before case body.");
 		// Push value being switched on onto stack.
-		WriteIndexOp(CurrentChunk(), switchedOnIndex, switchedOn.line, OP_GET_LOCAL, OP_GET_LOCAL_LONG);
-		EmitByte(OP_EQUAL);
-		nextCaseJump = EmitJump(OP_JUMP_IF_FALSE);
-		EmitByte(OP_POP); // true value if we didn't jump
-		Statement();	// require at least 1 statement
-		while (!Check(TOKEN_CASE) && !Check(TOKEN_DEFAULT) && !Check(TOKEN_RIGHT_BRACE))
+		WriteIndexOp(CurrentChunk(parser), switchedOnIndex, switchedOn.line, OP_GET_LOCAL, OP_GET_LOCAL_LONG);
+		EmitByte(parser, OP_EQUAL);
+		nextCaseJump = EmitJump(parser, OP_JUMP_IF_FALSE);
+		EmitByte(parser, OP_POP); // true value if we didn't jump
+		Statement(parser);	// require at least 1 statement
+		while (!Check(parser, TOKEN_CASE) && !Check(parser, TOKEN_DEFAULT) && !Check(parser, TOKEN_RIGHT_BRACE))
 		{
-			Statement();
+			Statement(parser);
 		}
 
 		if (endJumpsCount >= endJumpsCap) {
 			int oldCap = endJumpsCap;
 			endJumpsCap = GROW_CAPACITY(endJumpsCap);
-			endJumps = GROW_ARRAY(int, endJumps, oldCap, endJumpsCap);
+			endJumps = ARENA_GROW_ARRAY(&parser->arena, int, endJumps, oldCap, endJumpsCap);
 		}
-		endJumps[endJumpsCount] = EmitJump(OP_JUMP);
+		endJumps[endJumpsCount] = EmitJump(parser, OP_JUMP);
 		endJumpsCount++;
 	}
 	// last case jumps to default or end of switch statement if cnd not met
-	PatchJump(nextCaseJump); 
-	EmitByte(OP_POP);
+	PatchJump(parser, nextCaseJump); 
+	EmitByte(parser, OP_POP);
 
-	if (Match(TOKEN_DEFAULT))
+	if (Match(parser, TOKEN_DEFAULT))
 	{
-		Consume(TOKEN_COLON, "Expect ':' before case body.");
-		Statement();
-		while (!Check(TOKEN_RIGHT_BRACE))
+		Consume(parser, TOKEN_COLON, "Expect ':' before case body.");
+		Statement(parser);
+		while (!Check(parser, TOKEN_RIGHT_BRACE))
 		{
-			Statement();
+			Statement(parser);
 		}
 	}
 
-	Consume(TOKEN_RIGHT_BRACE, "Expect '}' after switch body");
+	Consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after switch body");
 
 	for (int i = 0; i < endJumpsCount; i++)
 	{
-		PatchJump(endJumps[i]);
+		PatchJump(parser, endJumps[i]);
 	}
 
-	FREE_ARRAY(int, endJumps, endJumpsCap);
-
-	EndScope();
+	EndScope(parser);
 
 	// PatchJump(endJump);
 }
 
-static void ContinueStatement()
+static void ContinueStatement(Parser* parser)
 {
-	if (currentLoopData->startInstructionIndex == -1)
+	if (parser->loopData == NULL)
 	{
-		Error("Can only use continue statement in loops.");
+		Error(parser, "Can only use continue statement in loops.");
 		return;
 	}
 
-	Consume(TOKEN_SEMICOLON, "Expect ';' after continue.");
+	Consume(parser, TOKEN_SEMICOLON, "Expect ';' after continue.");
 
 	// Pop everything in loop scope and scopes nested inside loop
 	int popCount = 0;
-	for (int i = currentCompiler->localsCount - 1; i >= 0 && currentCompiler->locals[i].depth >= currentLoopData->bodyScopeDepth; i--)
+	for (int i = parser->compiler->localsCount - 1; i >= 0 && parser->compiler->locals[i].depth >= parser->loopData->bodyScopeDepth; i--)
 	{
 		popCount++;
 	}
@@ -832,91 +1053,93 @@ static void ContinueStatement()
 	assert(popCount <= UINT8_MAX);
 	if (popCount > 0)
 	{
-		EmitByte(OP_POPN);
-		EmitByte((uint8_t)popCount);
+		EmitByte(parser, OP_POPN);
+		EmitByte(parser, (uint8_t)popCount);
 	}
-	
-	//while (currentCompiler->currentScopeDepth >= currentLoopData->bodyScopeDepth)
-	//{
-	//	EndScope(); // Pop local variables in loop body allocated before continue statement
-	//}
-	//BeginScope(); 
 
-	EmitLoopJump(currentLoopData->startInstructionIndex);
+	if (parser->loopData->continueJumpsCount >= parser->loopData->continueJumpsCap)
+	{
+		int oldCap = parser->loopData->continueJumpsCap;
+		parser->loopData->continueJumpsCap = GROW_CAPACITY(oldCap);
+		parser->loopData->continueJumps = ARENA_GROW_ARRAY(&parser->arena, int, parser->loopData->continueJumps, oldCap, 
+			parser->loopData->continueJumpsCap);
+	}
+	parser->loopData->continueJumps[parser->loopData->continueJumpsCount++] = EmitJump(parser, OP_JUMP);
 }
 
-static void ReturnStatement()
+static void ReturnStatement(Parser* parser)
 {
-	if (currentCompiler->type == TYPE_SCRIPT)
+	if (parser->compiler->type == TYPE_SCRIPT)
 	{
-		Error("Can't return from top level code.");
+		Error(parser, "Can't return from top level code.");
 	}
 
-	if (Match(TOKEN_SEMICOLON))
+	if (Match(parser, TOKEN_SEMICOLON))
 	{
-		EmitByte(OP_NIL);
-		EmitByte(OP_RETURN);
+		EmitByte(parser, OP_NIL);
+		EmitByte(parser, OP_RETURN);
 	}
 	else
 	{
-		Expression();
-		EmitByte(OP_RETURN);
-		Consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+		Expression(parser);
+		EmitByte(parser, OP_RETURN);
+		Consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
 	}
 }
 
-static void Statement()
+static void Statement(Parser* parser)
 {
-	if (Match(TOKEN_PRINT)) {
-		PrintStatement();
+	if (Match(parser, TOKEN_PRINT)) {
+		PrintStatement(parser);
 	}
-	else if (Match(TOKEN_LEFT_BRACE))
+	else if (Match(parser, TOKEN_LEFT_BRACE))
 	{
-		BeginScope();
-		Block();
-		EndScope();
+		BeginScope(parser);
+		Block(parser);
+		EndScope(parser);
 	}
-	else if (Match(TOKEN_IF))
+	else if (Match(parser, TOKEN_IF))
 	{
-		IfStatement();
+		IfStatement(parser);
 	}
-	else if (Match(TOKEN_WHILE))
+	else if (Match(parser, TOKEN_WHILE))
 	{
-		WhileStatement();
+		WhileStatement(parser);
 	}
-	else if (Match(TOKEN_FOR))
+	else if (Match(parser, TOKEN_FOR))
 	{
-		ForStatement();
+		ForStatement(parser);
 	}
-	else if (Match(TOKEN_SWITCH))
+	else if (Match(parser, TOKEN_SWITCH))
 	{
-		SwitchStatement();
+		SwitchStatement(parser);
 	}
-	else if (Match(TOKEN_CONTINUE))
+	else if (Match(parser, TOKEN_CONTINUE))
 	{
-		ContinueStatement();
+		ContinueStatement(parser);
 	}
-	else if (Match(TOKEN_RETURN))
+	else if (Match(parser, TOKEN_RETURN))
 	{
-		ReturnStatement();
+		ReturnStatement(parser);
 	}
 	else
 	{
-		ExpressionStatement();
+		ExpressionStatement(parser);
 	}
 }
 
-static void Synchronize()
+static void Synchronize(Parser* parser)
 {
-	parser.panicMode = false;
+	parser->panicMode = false;
 
-	while (parser.current.type != TOKEN_EOF)
+	while (parser->current.type != TOKEN_EOF)
 	{
-		if (parser.previous.type == TOKEN_SEMICOLON) return;
+		if (parser->previous.type == TOKEN_SEMICOLON) return;
 
-		switch (parser.current.type)
+		switch (parser->current.type)
 		{
 		case TOKEN_CLASS:
+		case TOKEN_CONST:
 		case TOKEN_FUN:
 		case TOKEN_VAR:
 		case TOKEN_FOR:
@@ -930,152 +1153,376 @@ static void Synchronize()
 			;
 		}
 
-		Advance();
+		Advance(parser);
 	}
 }
 
-static void AddLocal(Token* name)
+static void AddLocal(Parser* parser, Token* name)
 {
-	if (currentCompiler->localsCount >= MAX_LOCALS)
+	if (parser->compiler->localsCount >= MAX_LOCALS)
 	{
-		Error("Too many local variables in function.");
+		Error(parser, "Too many local variables in function.");
 		return;
 	}
-	Local* local = &currentCompiler->locals[currentCompiler->localsCount++];
+	Local* local = &parser->compiler->locals[parser->compiler->localsCount++];
 	local->name = *name;
 	local->depth = -1;
 }
 
-static void DeclareVariable(Token* name)
+static bool IsConstantInCurrentScope(Parser* parser, Token* name)
 {
-	// Token* name = &parser.previous;
-	for (int i = currentCompiler->localsCount - 1; i >= 0; i--)
+	for (int i = parser->compiler->constantsCount - 1; i >= 0; i--)
 	{
-		Local* local = &currentCompiler->locals[i];
-		if (local->depth != currentCompiler->currentScopeDepth) { break; }
+		Constant* constant = &parser->compiler->constants[i];
+		if (constant->depth != parser->compiler->currentScopeDepth) { break; }
+		if (IdentifiersEqual(&constant->name, name)) { return true; }
+	}
+	return false;
+}
+
+static void DeclareVariable(Parser* parser, Token* name)
+{
+	if (IsConstantInCurrentScope(parser, name))
+	{
+		Error(parser, "Already constant with this name in this scope.");
+		return;
+	}
+
+	// Token* name = &parser->previous;
+	for (int i = parser->compiler->localsCount - 1; i >= 0; i--)
+	{
+		Local* local = &parser->compiler->locals[i];
+		if (local->depth != parser->compiler->currentScopeDepth) { break; }
 		if (IdentifiersEqual(&local->name, name))
 		{
-			Error("Already variable with this name in this scope.");
+			Error(parser, "Already variable with this name in this scope.");
 			return;
 		}
 	}
 
-	AddLocal(name);
+	AddLocal(parser, name);
 }
 
-static int ParseVariable(const char* errorMessage)
+static int ParseVariable(Parser* parser, const char* errorMessage)
 {
-	Consume(TOKEN_IDENTIFIER, errorMessage);
-	if (currentCompiler->currentScopeDepth != 0)
+	Consume(parser, TOKEN_IDENTIFIER, errorMessage);
+	if (parser->compiler->currentScopeDepth != 0)
 	{
-		DeclareVariable(&parser.previous);
+		DeclareVariable(parser, &parser->previous);
 		return -1; // dummy value, don't add local var to constants array
 	}
-	return IdentifierConstant(&parser.previous);
+	if (IsConstantInCurrentScope(parser, &parser->previous))
+	{
+		Error(parser, "Already constant with this name in this scope.");
+	}
+	return IdentifierConstant(parser, &parser->previous);
 }
 
-static void MarkInitialized()
+static void MarkInitialized(Parser* parser)
 {
-	currentCompiler->locals[currentCompiler->localsCount - 1].depth = currentCompiler->currentScopeDepth;
+	parser->compiler->locals[parser->compiler->localsCount - 1].depth = parser->compiler->currentScopeDepth;
 }
 
-static void DefineVariable(int global, int line)
+static void DefineVariable(Parser* parser, int global, int line)
 {
-	if (currentCompiler->currentScopeDepth != 0)
+	if (parser->compiler->currentScopeDepth != 0)
 	{
-		MarkInitialized();
+		MarkInitialized(parser);
 	}
-	else WriteGlobalDeclaration(CurrentChunk(), global, line);
+	else WriteGlobalDeclaration(CurrentChunk(parser), global, line);
 }
 
-static void VarDeclaration()
+static void VarDeclaration(Parser* parser)
 {
-	int global = ParseVariable("Expect variable name.");
-	int line = parser.previous.line;
+	int global = ParseVariable(parser, "Expect variable name.");
+	int line = parser->previous.line;
 
-	if (Match(TOKEN_EQUAL))
+	if (Match(parser, TOKEN_EQUAL))
 	{
-		Expression();
+		Expression(parser);
 	}
 	else
 	{
-		EmitByte(OP_NIL);
+		EmitByte(parser, OP_NIL);
+	}
+
+	Consume(parser, TOKEN_SEMICOLON, "Expect ';' after var declaration.");
+
+	DefineVariable(parser, global, line);
+}
+
+static bool ConstantValuesEqual(Value a, Value b)
+{
+	if (a.type != b.type) { return false; }
+
+	switch (a.type)
+	{
+	case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+	case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
+	case VAL_NIL: return true;
+	case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b); // string constants are interned
+	default:
+		return false; // unreachable
+	}
+}
+
+#define FOLD_STACK_MAX 64
+
+// Evaluates the instructions emitted since 'codeStart'. Only literals, arithmetic, comparisons and other
+// constants are allowed. Returns false if the code isn't a compile time constant expression.
+static bool FoldConstantExpression(Parser* parser, int codeStart, Value* outValue)
+{
+	Chunk* chunk = CurrentChunk(parser);
+	Value stack[FOLD_STACK_MAX];
+	int count = 0;
+
+#define FOLD_BINARY_OP(convertFunc, op) \
+	do { \
+		if (count < 2 || !IS_NUMBER(stack[count - 1]) || !IS_NUMBER(stack[count - 2])) return false; \
+		double b = AS_NUMBER(stack[--count]); \
+		stack[count - 1] = convertFunc(AS_NUMBER(stack[count - 1]) op b); \
+	} while (false)
+
+	for (int i = codeStart; i < chunk->count;)
+	{
+		if (count >= FOLD_STACK_MAX) { return false; }
+
+		switch (chunk->code[i++])
+		{
+		case OP_CONSTANT: stack[count++] = chunk->constants.values[chunk->code[i]]; i += 1; break;
+		case OP_CONSTANT_LONG:
+			stack[count++] = chunk->constants.values[chunk->code[i] | (chunk->code[i + 1] << 8) | (chunk->code[i + 2] << 16)];
+			i += 3;
+			break;
+		case OP_NIL: stack[count++] = NIL_VAL; break;
+		case OP_TRUE: stack[count++] = BOOL_VAL(true); break;
+		case OP_FALSE: stack[count++] = BOOL_VAL(false); break;
+		case OP_NOT:
+		{
+			if (count < 1) { return false; }
+			Value value = stack[count - 1];
+			stack[count - 1] = BOOL_VAL(IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)));
+			break;
+		}
+		case OP_NEGATE:
+			if (count < 1 || !IS_NUMBER(stack[count - 1])) { return false; }
+			AS_NUMBER(stack[count - 1]) = -AS_NUMBER(stack[count - 1]);
+			break;
+		case OP_EQUAL:
+			if (count < 2) { return false; }
+			count--;
+			stack[count - 1] = BOOL_VAL(ConstantValuesEqual(stack[count - 1], stack[count]));
+			break;
+		case OP_NOT_EQUAL:
+			if (count < 2) { return false; }
+			count--;
+			stack[count - 1] = BOOL_VAL(!ConstantValuesEqual(stack[count - 1], stack[count]));
+			break;
+		case OP_GREATER: FOLD_BINARY_OP(BOOL_VAL, >); break;
+		case OP_GREATER_EQUAL: FOLD_BINARY_OP(BOOL_VAL, >=); break;
+		case OP_LESS: FOLD_BINARY_OP(BOOL_VAL, <); break;
+		case OP_LESS_EQUAL: FOLD_BINARY_OP(BOOL_VAL, <=); break;
+		case OP_ADD: FOLD_BINARY_OP(NUMBER_VAL, +); break;
+		case OP_SUB: FOLD_BINARY_OP(NUMBER_VAL, -); break;
+		case OP_MULT: FOLD_BINARY_OP(NUMBER_VAL, *); break;
+		case OP_DIV: FOLD_BINARY_OP(NUMBER_VAL, /); break;
+		case OP_ADD_N:
+		{
+			int operands = chunk->code[i++];
+			if (count < operands) { return false; }
+			count -= operands;
+			for (int j = 0; j < operands; j++)
+			{
+				if (!IS_NUMBER(stack[count + j])) { return false; }
+			}
+			for (int j = 1; j < operands; j++)
+			{
+				AS_NUMBER(stack[count]) += AS_NUMBER(stack[count + j]);
+			}
+			count++;
+			break;
+		}
+		default:
+			return false;
+		}
 	}
 
-	Consume(TOKEN_SEMICOLON, "Expect ';' after var declaration.");
+#undef FOLD_BINARY_OP
 
-	DefineVariable(global, line);
+	if (count != 1) { return false; }
+	*outValue = stack[0];
+	return true;
 }
 
-static void Function(FunctionType type)
+static void ConstDeclaration(Parser* parser)
+{
+	Consume(parser, TOKEN_IDENTIFIER, "Expect constant name.");
+	Token name = parser->previous;
+
+	if (IsConstantInCurrentScope(parser, &name))
+	{
+		Error(parser, "Already constant with this name in this scope.");
+	}
+	for (int i = parser->compiler->localsCount - 1; i >= 0; i--)
+	{
+		Local* local = &parser->compiler->locals[i];
+		if (local->depth != parser->compiler->currentScopeDepth) { break; }
+		if (IdentifiersEqual(&local->name, &name))
+		{
+			Error(parser, "Already variable with this name in this scope.");
+		}
+	}
+
+	Consume(parser, TOKEN_EQUAL, "Expect '=' after constant name.");
+
+	// The initializer is compiled like any other expression and then evaluated and removed from the chunk.
+	int codeStart = CurrentChunk(parser)->count;
+	Expression(parser);
+	Consume(parser, TOKEN_SEMICOLON, "Expect ';' after const declaration.");
+
+	// After a parse error the initializer's code can be missing operands, there's no point folding it.
+	Value value = NIL_VAL;
+	if (!parser->hadError && !FoldConstantExpression(parser, codeStart, &value))
+	{
+		Error(parser, "Const initializer must be a constant expression.");
+	}
+	TruncateChunk(CurrentChunk(parser), codeStart);
+
+	if (parser->compiler->constantsCount >= MAX_CONSTANTS)
+	{
+		Error(parser, "Too many constants in function.");
+		return;
+	}
+	Constant* constant = &parser->compiler->constants[parser->compiler->constantsCount++];
+	constant->name = name;
+	constant->depth = parser->compiler->currentScopeDepth;
+	constant->value = value;
+}
+
+static void Function(Parser* parser, FunctionType type)
 {
 	Compiler compiler;
-	InitCompiler(&compiler, type);
-	BeginScope();
+	InitCompiler(parser, &compiler, type);
+	LoopData* enclosingLoopData = parser->loopData;
+	parser->loopData = NULL; // continue can't jump out of a function body
+	BeginScope(parser);
 
-	Consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-	if (!Check(TOKEN_RIGHT_PAREN))
+	Consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+	if (!Check(parser, TOKEN_RIGHT_PAREN))
 	{
 		do {
-			currentCompiler->function->arity++;
-			if (currentCompiler->function->arity > 255) {
-				ErrorAtCurrent("Can't have more than 255 parameters.");
+			parser->compiler->function->arity++;
+			if (parser->compiler->function->arity > 255) {
+				ErrorAtCurrent(parser, "Can't have more than 255 parameters.");
 			}
-			uint8_t paramConstant = ParseVariable("Expect parameter name.");
-			DefineVariable(paramConstant, parser.previous.line);
-		} while (Match(TOKEN_COMMA));
+			uint8_t paramConstant = ParseVariable(parser, "Expect parameter name.");
+			DefineVariable(parser, paramConstant, parser->previous.line);
+		} while (Match(parser, TOKEN_COMMA));
 	}
-	Consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+	Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
 
-	Consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-	Block();
+	Consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+	Block(parser);
 
-	ObjFunction* function = EndCompiler();
-	WriteConstant(CurrentChunk(), OBJ_VAL(function), parser.previous.line);
+	ObjFunction* function = EndCompiler(parser);
+	parser->loopData = enclosingLoopData;
+	EmitConstant(parser, OBJ_VAL(function));
 }
 
-static void FuncDeclaration()
+static void FuncDeclaration(Parser* parser)
 {
-	int global = ParseVariable("Expect function name.");
-	int line = parser.previous.line;
+	int global = ParseVariable(parser, "Expect function name.");
+	int line = parser->previous.line;
 	// Mark local function as initialized to allow for the function to refer to itself (recursion).
-	if (currentCompiler->currentScopeDepth > 0) MarkInitialized();
-	Function(TYPE_FUNCTION);
-	DefineVariable(global, line);
+	if (parser->compiler->currentScopeDepth > 0) MarkInitialized(parser);
+	Function(parser, TYPE_FUNCTION);
+	DefineVariable(parser, global, line);
 }
 
-static void Declaration()
+static void Declaration(Parser* parser)
 {
-	if (Match(TOKEN_VAR))
+	if (Match(parser, TOKEN_VAR))
 	{
-		VarDeclaration();
+		VarDeclaration(parser);
 	}
-	else if (Match(TOKEN_FUN))
+	else if (Match(parser, TOKEN_CONST))
 	{
-		FuncDeclaration();
+		ConstDeclaration(parser);
+	}
+	else if (Match(parser, TOKEN_FUN))
+	{
+		FuncDeclaration(parser);
 	}
 	else
 	{
-		Statement();
+		Statement(parser);
+	}
+
+	if (parser->panicMode) { Synchronize(parser); }
+}
+
+// Functions that are still being compiled, and the constants they refer to, aren't reachable from the VM yet.
+void MarkCompilerRoots(VM* vm)
+{
+	if (vm->parser == NULL) return;
+
+	for (Compiler* compiler = vm->parser->compiler; compiler != NULL; compiler = compiler->enclosing)
+	{
+		MarkObject(vm, (Obj*)compiler->function);
+		for (int i = 0; i < compiler->constantsCount; i++) MarkValue(vm, compiler->constants[i].value);
 	}
+}
 
-	if (parser.panicMode) { Synchronize(); }
+// The arena's out of memory handler. The functions being compiled are garbage from here on, but an incremental
+// cycle may already have them on the gray stack, so their chunks stop pointing into the arena before it goes.
+static void AbandonCompile(void* context)
+{
+	Parser* parser = (Parser*)context;
+	for (Compiler* compiler = parser->compiler; compiler != NULL; compiler = compiler->enclosing)
+	{
+		InitChunk(&compiler->function->chunk);
+	}
+	longjmp(parser->outOfMemory, 1);
 }
 
-ObjFunction* Compile(const char* source)
+ObjFunction* Compile(VM* vm, const char* source)
 {
-	InitScanner(source);
+	Parser parser;
+	parser.vm = vm;
+	InitScanner(&parser.scanner, source);
 	parser.hadError = parser.panicMode = false;
+	parser.compiler = NULL;
+	parser.loopData = NULL;
+	InitArena(&parser.arena, AbandonCompile, &parser);
+	vm->parser = &parser;
+	// A heap used up by an earlier script mustn't fail this compile, nor be blamed on the script compiled here.
+	RecoverHeap(vm);
+
+	if (setjmp(parser.outOfMemory) != 0)
+	{
+		FreeArena(&parser.arena);
+		vm->parser = NULL;
+		fprintf(stderr, "Out of memory while compiling.\n");
+		return NULL;
+	}
+
 	Compiler compiler;
-	InitCompiler(&compiler, TYPE_SCRIPT);
-	LoopData loopData;
-	loopData.startInstructionIndex = loopData.endInstructionIndex = loopData.bodyScopeDepth = -1;
-	currentLoopData = &loopData;
-	Advance();
-	while (!Match(TOKEN_EOF))
+	InitCompiler(&parser, &compiler, TYPE_SCRIPT);
+	Advance(&parser);
+	while (!Match(&parser, TOKEN_EOF))
+	{
+		Declaration(&parser);
+	}
+	ObjFunction* function = EndCompiler(&parser);
+	FreeArena(&parser.arena);
+	vm->parser = NULL;
+
+	// The allocations all went through, but running a script that was compiled with no room left would only 
+	// fail at its first check.
+	if (vm->heapExhausted)
 	{
-		Declaration();
+		fprintf(stderr, "Out of memory while compiling.\n");
+		parser.hadError = true;
 	}
-	ObjFunction* function = EndCompiler();
 	return !parser.hadError ? function : NULL;
 }
@@ -4,6 +4,7 @@
 #include "chunk.h"
 #include "object.h"
 
-ObjFunction* Compile(const char* source);
+ObjFunction* Compile(VM* vm, const char* source);
+void MarkCompilerRoots(VM* vm);
 
 #endif
@@ -4,13 +4,13 @@
 
 #include "value.h"
 
-void DisassembleChunk(Chunk* chunk, const char* name)
+void DisassembleChunk(VM* vm, Chunk* chunk, const char* name)
 {
 	printf("== %s ==\n", name);
 	printf("OpCode	Line	Name\n");
 	for (int i = 0; i < chunk->count;)
 	{
-		i = DisassembleInstruction(chunk, i);
+		i = DisassembleInstruction(vm, chunk, i);
 	}
 }
 
@@ -20,20 +20,20 @@ static int SimpleInstruction(const char* name, int offset)
 	return offset + 1;
 }
 
-static int ConstantInstruction(const char* name, Chunk* chunk, int offset)
+static int ConstantInstruction(VM* vm, const char* name, Chunk* chunk, int offset)
 {
 	uint8_t constant_index = chunk->code[offset + 1];
 	printf("%-16s %4d '", name, constant_index);
-	PrintValue(chunk->constants.values[constant_index]);
+	PrintValue(vm, chunk->constants.values[constant_index]);
 	printf("'\n");
 	return offset + 2;
 }
 
-static int ConstantLongInstruction(const char* name, Chunk* chunk, int offset)
+static int ConstantLongInstruction(VM* vm, const char* name, Chunk* chunk, int offset)
 {
 	int constant_index = (chunk->code[offset + 1]) | (chunk->code[offset + 2] << 8) | (chunk->code[offset + 3] << 16);
 	printf("%-16s %4d '", name, constant_index);
-	PrintValue(chunk->constants.values[constant_index]);
+	PrintValue(vm, chunk->constants.values[constant_index]);
 	printf("'\n");
 	return offset + 4;
 }
@@ -47,6 +47,14 @@ static int IndexInstruction(const char* name, Chunk* chunk, int offset)
 	return offset + 2;
 }
 
+static int IncrementInstruction(const char* name, Chunk* chunk, int offset)
+{
+	uint8_t index = chunk->code[offset + 1];
+	int8_t delta = (int8_t)chunk->code[offset + 2];
+	printf("%-16s %4d %+d\n", name, index, delta);
+	return offset + 3;
+}
+
 static int IndexLongInstruction(const char* name, Chunk* chunk, int offset)
 {
 	int index = (chunk->code[offset + 1]) | (chunk->code[offset + 2] << 8) | (chunk->code[offset + 3] << 16);
@@ -54,7 +62,7 @@ static int IndexLongInstruction(const char* name, Chunk* chunk, int offset)
 	return offset + 4;
 }
 
-int DisassembleInstruction(Chunk* chunk, int offset)
+int DisassembleInstruction(VM* vm, Chunk* chunk, int offset)
 {
 	printf("%04d ", offset);
 
@@ -73,9 +81,9 @@ int DisassembleInstruction(Chunk* chunk, int offset)
 	switch (instruction)
 	{
 	case OP_CONSTANT: 
-		return ConstantInstruction("OP_CONSTANT", chunk, offset);
+		return ConstantInstruction(vm, "OP_CONSTANT", chunk, offset);
 	case OP_CONSTANT_LONG:
-		return ConstantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+		return ConstantLongInstruction(vm, "OP_CONSTANT_LONG", chunk, offset);
 	case OP_NIL:
 		return SimpleInstruction("OP_NIL", offset);
 	case OP_TRUE:
@@ -108,6 +116,8 @@ int DisassembleInstruction(Chunk* chunk, int offset)
 		return SimpleInstruction("OP_MULT", offset);
 	case OP_DIV:
 		return SimpleInstruction("OP_DIV", offset);
+	case OP_ADD_N:
+		return IndexInstruction("OP_ADD_N", chunk, offset);
 	case OP_PRINT:
 		return SimpleInstruction("OP_PRINT", offset);
 	case OP_POP:
@@ -115,17 +125,17 @@ int DisassembleInstruction(Chunk* chunk, int offset)
 	case OP_POPN:
 		return IndexInstruction("OP_POPN", chunk, offset);
 	case OP_DEFINE_GLOBAL:
-		return ConstantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+		return ConstantInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
 	case OP_DEFINE_GLOBAL_LONG:
-		return ConstantLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+		return ConstantLongInstruction(vm, "OP_DEFINE_GLOBAL_LONG", chunk, offset);
 	case OP_GET_GLOBAL:
-		return ConstantInstruction("OP_GET_GLOBAL", chunk, offset);
+		return ConstantInstruction(vm, "OP_GET_GLOBAL", chunk, offset);
 	case OP_GET_GLOBAL_LONG:
-		return ConstantLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+		return ConstantLongInstruction(vm, "OP_GET_GLOBAL_LONG", chunk, offset);
 	case OP_SET_GLOBAL:
-		return ConstantInstruction("OP_SET_GLOBAL", chunk, offset);
+		return ConstantInstruction(vm, "OP_SET_GLOBAL", chunk, offset);
 	case OP_SET_GLOBAL_LONG:
-		return ConstantLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+		return ConstantLongInstruction(vm, "OP_SET_GLOBAL_LONG", chunk, offset);
 	case OP_GET_LOCAL:
 		return IndexInstruction("OP_GET_LOCAL", chunk, offset);
 	case OP_GET_LOCAL_LONG:
@@ -134,6 +144,26 @@ int DisassembleInstruction(Chunk* chunk, int offset)
 		return IndexInstruction("OP_SET_LOCAL", chunk, offset);
 	case OP_SET_LOCAL_LONG:
 		return IndexLongInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+	case OP_ADD_LOCAL:
+		return IndexInstruction("OP_ADD_LOCAL", chunk, offset);
+	case OP_SUB_LOCAL:
+		return IndexInstruction("OP_SUB_LOCAL", chunk, offset);
+	case OP_MULT_LOCAL:
+		return IndexInstruction("OP_MULT_LOCAL", chunk, offset);
+	case OP_DIV_LOCAL:
+		return IndexInstruction("OP_DIV_LOCAL", chunk, offset);
+	case OP_INCREMENT_LOCAL:
+		return IncrementInstruction("OP_INCREMENT_LOCAL", chunk, offset);
+	case OP_ADD_GLOBAL:
+		return ConstantInstruction(vm, "OP_ADD_GLOBAL", chunk, offset);
+	case OP_SUB_GLOBAL:
+		return ConstantInstruction(vm, "OP_SUB_GLOBAL", chunk, offset);
+	case OP_MULT_GLOBAL:
+		return ConstantInstruction(vm, "OP_MULT_GLOBAL", chunk, offset);
+	case OP_DIV_GLOBAL:
+		return ConstantInstruction(vm, "OP_DIV_GLOBAL", chunk, offset);
+	case OP_INCREMENT_GLOBAL:
+		return IncrementInstruction("OP_INCREMENT_GLOBAL", chunk, offset);
 	case OP_JUMP:
 		return IndexLongInstruction("OP_JUMP", chunk, offset);
 	case OP_JUMP_IF_FALSE:
@@ -142,10 +172,42 @@ int DisassembleInstruction(Chunk* chunk, int offset)
 		return IndexLongInstruction("OP_JUMP_IF_TRUE", chunk, offset);
 	case OP_JUMP_BACK:
 		return IndexLongInstruction("OP_JUMP_BACK", chunk, offset);
+	case OP_JUMP_BACK_IF_TRUE:
+		return IndexLongInstruction("OP_JUMP_BACK_IF_TRUE", chunk, offset);
 	case OP_CALL:
 		return IndexInstruction("OP_CALL", chunk, offset);
 	case OP_RETURN:
 		return SimpleInstruction("OP_RETURN", offset);
+	case OP_NEGATE_NUMBER:
+		return SimpleInstruction("OP_NEGATE_NUMBER", offset);
+	case OP_GREATER_NUMBER:
+		return SimpleInstruction("OP_GREATER_NUMBER", offset);
+	case OP_GREATER_EQUAL_NUMBER:
+		return SimpleInstruction("OP_GREATER_EQUAL_NUMBER", offset);
+	case OP_LESS_NUMBER:
+		return SimpleInstruction("OP_LESS_NUMBER", offset);
+	case OP_LESS_EQUAL_NUMBER:
+		return SimpleInstruction("OP_LESS_EQUAL_NUMBER", offset);
+	case OP_ADD_NUMBER:
+		return SimpleInstruction("OP_ADD_NUMBER", offset);
+	case OP_SUB_NUMBER:
+		return SimpleInstruction("OP_SUB_NUMBER", offset);
+	case OP_MULT_NUMBER:
+		return SimpleInstruction("OP_MULT_NUMBER", offset);
+	case OP_DIV_NUMBER:
+		return SimpleInstruction("OP_DIV_NUMBER", offset);
+	case OP_ADD_N_NUMBER:
+		return IndexInstruction("OP_ADD_N_NUMBER", chunk, offset);
+	case OP_ADD_LOCAL_NUMBER:
+		return IndexInstruction("OP_ADD_LOCAL_NUMBER", chunk, offset);
+	case OP_SUB_LOCAL_NUMBER:
+		return IndexInstruction("OP_SUB_LOCAL_NUMBER", chunk, offset);
+	case OP_MULT_LOCAL_NUMBER:
+		return IndexInstruction("OP_MULT_LOCAL_NUMBER", chunk, offset);
+	case OP_DIV_LOCAL_NUMBER:
+		return IndexInstruction("OP_DIV_LOCAL_NUMBER", chunk, offset);
+	case OP_INCREMENT_LOCAL_NUMBER:
+		return IncrementInstruction("OP_INCREMENT_LOCAL_NUMBER", chunk, offset);
 	default:
 		printf("Unknown opcode %d\n", instruction);
 		return offset + 1;
@@ -3,7 +3,7 @@
 
 #include "chunk.h"
 
-void DisassembleChunk(Chunk* chunk, const char* name);
-int DisassembleInstruction(Chunk* chunk, int offset);
+void DisassembleChunk(VM* vm, Chunk* chunk, const char* name);
+int DisassembleInstruction(VM* vm, Chunk* chunk, int offset);
 
 #endif // clox_debug_h
@@ -3,20 +3,12 @@
 #include <assert.h>
 #include <stdlib.h>
 
-#include "memory.h"
-
 void InitLineRunArray(LineRunArray* arr)
 {
 	arr->count = arr->capacity = 0;
 	arr->runs = NULL;
 }
 
-void FreeLineRunArray(LineRunArray* arr)
-{
-	FREE_ARRAY(LineRun, arr->runs, arr->capacity);
-	InitLineRunArray(arr);
-}
-
 void WriteLine(LineRunArray* arr, int line)
 {
 	/*assert(arr->count == 0 || arr->runs[arr->count - 1].line <= line && 
@@ -28,14 +20,20 @@ void WriteLine(LineRunArray* arr, int line)
 		return;
 	}
 
-	if (arr->count >= arr->capacity)
-	{
-		int old_capacity = arr->capacity;
-		arr->capacity = GROW_CAPACITY(old_capacity);
-		arr->runs = GROW_ARRAY(LineRun, arr->runs, old_capacity, arr->capacity);
-	}
-
+	assert(arr->count < arr->capacity && "The owner of the array makes room for new runs.");
 	arr->runs[arr->count].line = line;
 	arr->runs[arr->count].count = 1;
 	arr->count++;
 }
+
+void RemoveLines(LineRunArray* arr, int count)
+{
+	while (count > 0)
+	{
+		LineRun* last = &arr->runs[arr->count - 1];
+		int removed = last->count < count ? last->count : count;
+		last->count -= removed;
+		count -= removed;
+		if (last->count == 0) { arr->count--; }
+	}
+}
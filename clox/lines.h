@@ -16,8 +16,11 @@ typedef struct
 } LineRunArray;
 
 void InitLineRunArray(LineRunArray* arr);
-void FreeLineRunArray(LineRunArray* arr);
+// The array has to have room for another run, line runs live in the chunk's arena while they are written, see 
+// WriteChunk().
 void WriteLine(LineRunArray* arr, int line);
+// Drops the lines of the last 'count' instructions.
+void RemoveLines(LineRunArray* arr, int count);
 
 #endif // !clox_lines_h
 
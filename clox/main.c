@@ -1,15 +1,20 @@
 #include "common.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "memory.h"
+#include "scanner.h"
 #include "vm.h"
+#include "workers.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #pragma warning (disable: 4996)
 
-static void REPL()
+static void REPL(VM* vm)
 {
 	char line[1024];
 	while (true)
@@ -22,7 +27,7 @@ static void REPL()
 			break;
 		}
 
-		Interpret(line);
+		Interpret(vm, line);
 	}
 }
 
@@ -57,34 +62,462 @@ static char* ReadFile(const char* path)
 	return buffer;
 }
 
-static void RunFile(const char* path)
+static void RunFile(VM* vm, const char* path, bool printGCStats, bool printMemStats)
 {
 	char* source = ReadFile(path);
-	InterpretResult result = Interpret(source);
+	InterpretResult result = Interpret(vm, source);
 	free(source);
+	if (printGCStats) PrintGCStats(vm);
+	if (printMemStats) PrintMemStats(vm);
 
 	if (result == INTERPRET_COMPILE_ERROR) exit(65);
 	if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+// Scans the file repeatedly for about a second and reports tokenizer throughput.
+static void BenchmarkScanner(const char* path)
+{
+	char* source = ReadFile(path);
+	size_t sourceLength = strlen(source);
+
+	long long tokens = 0;
+	int passes = 0;
+	clock_t start = clock();
+	clock_t elapsed;
+	do
+	{
+		Scanner scanner;
+		InitScanner(&scanner, source);
+		while (ScanToken(&scanner).type != TOKEN_EOF) { tokens++; }
+		passes++;
+		elapsed = clock() - start;
+	} while (elapsed < CLOCKS_PER_SEC);
+
+	double seconds = (double)elapsed / CLOCKS_PER_SEC;
+	double megabytes = (double)sourceLength * passes / (1024.0 * 1024.0);
+	printf("%d passes, %lld tokens in %.3fs: %.1f MB/s, %.1f Mtokens/s\n", 
+		passes, tokens, seconds, megabytes / seconds, tokens / seconds / 1e6);
+
+	free(source);
+}
+
+// Compiles the file repeatedly for about a second and reports compile times.
+static void BenchmarkCompiler(VM* vm, const char* path)
+{
+	char* source = ReadFile(path);
+	size_t sourceLength = strlen(source);
+
+	int passes = 0;
+	clock_t start = clock();
+	clock_t elapsed;
+	do
+	{
+		if (Compile(vm, source) == NULL)
+		{
+			free(source);
+			exit(65);
+		}
+		passes++;
+		elapsed = clock() - start;
+	} while (elapsed < CLOCKS_PER_SEC);
+
+	double seconds = (double)elapsed / CLOCKS_PER_SEC;
+	double megabytes = (double)sourceLength * passes / (1024.0 * 1024.0);
+	printf("%d passes in %.3fs: %.2f ms per compile, %.1f MB/s\n", 
+		passes, seconds, seconds * 1000.0 / passes, megabytes / seconds);
+
+	free(source);
+}
+
+// Reports HashString() throughput for identifier sized and kilobyte sized strings.
+static void BenchmarkHash()
+{
+	static const int lengths[] = { 4, 8, 12, 16, 24, 1024 };
+	char buffer[1024];
+	for (int i = 0; i < (int)sizeof(buffer); i++) buffer[i] = 'a' + i % 26;
+
+	for (int i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); i++)
+	{
+		int length = lengths[i];
+		int iterations = 200000000 / (length + 16);
+		uint32_t sink = 0;
+
+		clock_t start = clock();
+		for (int j = 0; j < iterations; j++)
+		{
+			buffer[0] = (char)j; // keep the compiler from hoisting the hash out of the loop
+			sink ^= HashString(buffer, length);
+		}
+		double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+		printf("%5d bytes: %6.2f ns per hash, %7.1f MB/s (%08x)\n", length, seconds * 1e9 / iterations,
+			(double)length * iterations / (1024.0 * 1024.0) / seconds, sink);
+	}
+}
+
+static double NanosecondsPerOp(clock_t start, int ops)
+{
+	return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / ops;
+}
+
+// Times inserts, lookups (hits and misses) and deletes of 'count' string keys, 'rounds' times over.
+static void BenchmarkTableSize(VM* vm, int count, int rounds)
+{
+	ObjString** keys = (ObjString**)malloc(sizeof(ObjString*) * count * 2);
+	if (keys == NULL) exit(1);
+	char buffer[32];
+	for (int i = 0; i < count * 2; i++)
+	{
+		int length = sprintf(buffer, "key_%d", i);
+		keys[i] = CopyString(vm, buffer, length);
+		Push(vm, OBJ_VAL(keys[i])); // keeps the keys alive, the tables below aren't GC roots
+	}
+
+	double insertNs = 0, hitNs = 0, missNs = 0, deleteNs = 0;
+	Value value;
+	int found = 0;
+	for (int round = 0; round < rounds; round++)
+	{
+		Table table;
+		InitTable(&table);
+
+		clock_t start = clock();
+		for (int i = 0; i < count; i++) TableSet(vm, &table, keys[i], NUMBER_VAL(i));
+		insertNs += NanosecondsPerOp(start, count);
+
+		start = clock();
+		for (int i = 0; i < count; i++) found += TableGet(&table, keys[i], &value);
+		hitNs += NanosecondsPerOp(start, count);
+
+		start = clock();
+		for (int i = count; i < count * 2; i++) found += TableGet(&table, keys[i], &value);
+		missNs += NanosecondsPerOp(start, count);
+
+		start = clock();
+		for (int i = 0; i < count; i++) TableDelete(&table, keys[i]);
+		deleteNs += NanosecondsPerOp(start, count);
+
+		FreeTable(vm, &table);
+	}
+
+	printf("%8d keys: insert %6.1f ns, hit %6.1f ns, miss %6.1f ns, delete %6.1f ns (%d)\n", count,
+		insertNs / rounds, hitNs / rounds, missNs / rounds, deleteNs / rounds, found / rounds);
+	for (int i = 0; i < count * 2; i++) Pop(vm);
+	free(keys);
+}
+
+static void BenchmarkTable(VM* vm)
+{
+	BenchmarkTableSize(vm, 100, 20000);
+	BenchmarkTableSize(vm, 10000, 200);
+	BenchmarkTableSize(vm, 1000000, 3);
+}
+
+// Builds a 10 MB string 64 bytes at a time with 's = s + piece', then flattens it the way printing or comparing 
+// would.
+static void BenchmarkConcat(VM* vm)
+{
+	static const char* source =
+		"var piece = \"0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+-\";\n"
+		"var s = \"\";\n"
+		"for (var i = 0; i < 163840; i++) { s = s + piece; }\n";
+
+	clock_t start = clock();
+	if (Interpret(vm, source) != INTERPRET_OK) exit(70);
+	double buildSeconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	Value result;
+	if (!TableGet(&vm->globals, CopyString(vm, "s", 1), &result) || !IsStringValue(result)) exit(70);
+
+	start = clock();
+	ObjString* flat = IS_ROPE(result) ? FlattenRope(vm, AS_ROPE(result)) : AS_STRING(result);
+	double flattenSeconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	printf("%d bytes: build %.3fs, flatten %.3fs, total %.3fs\n", flat->length, buildSeconds, flattenSeconds,
+		buildSeconds + flattenSeconds);
+}
+
+// Calls Lox functions from C through CallFunction() and reports the cost per call.
+#define CALL_ITERATIONS 10000000
+
+static void BenchmarkCall(VM* vm)
+{
+	static const char* source =
+		"fun noop() {}\n"
+		"fun add(a, b) { return a + b; }\n";
+	if (Interpret(vm, source) != INTERPRET_OK) exit(70);
+
+	Value noop, add;
+	if (!GetGlobal(vm, "noop", &noop) || !GetGlobal(vm, "add", &add)) exit(70);
+
+	Value result = NIL_VAL;
+	clock_t start = clock();
+	for (int i = 0; i < CALL_ITERATIONS; i++)
+	{
+		if (CallFunction(vm, noop, 0, NULL, &result) != INTERPRET_OK) exit(70);
+	}
+	double noopNs = NanosecondsPerOp(start, CALL_ITERATIONS);
+
+	double sum = 0;
+	start = clock();
+	for (int i = 0; i < CALL_ITERATIONS; i++)
+	{
+		Value args[2] = { NUMBER_VAL(i), NUMBER_VAL(1) };
+		if (CallFunction(vm, add, 2, args, &result) != INTERPRET_OK) exit(70);
+		sum += AS_NUMBER(result);
+	}
+	double addNs = NanosecondsPerOp(start, CALL_ITERATIONS);
+
+	printf("noop(): %.1f ns per call, add(a, b): %.1f ns per call (%.0f)\n", noopNs, addNs, sum);
+}
+
+// Starts VMs that have the file run as a prelude for about a second each way, once by running it on every VM and once 
+// by cloning a snapshot, and reports the cost of a start.
+static void BenchmarkSnapshot(const char* path)
+{
+	char* source = ReadFile(path);
+
+	int coldStarts = 0;
+	clock_t start = clock();
+	clock_t elapsed;
+	do
+	{
+		VM vm;
+		InitVM(&vm);
+		if (Interpret(&vm, source) != INTERPRET_OK) exit(70);
+		FreeVM(&vm);
+		coldStarts++;
+		elapsed = clock() - start;
+	} while (elapsed < CLOCKS_PER_SEC);
+	double coldUs = (double)elapsed / CLOCKS_PER_SEC * 1e6 / coldStarts;
+
+	Snapshot snapshot;
+	start = clock();
+	if (TakeSnapshot(&snapshot, source) != INTERPRET_OK) exit(70);
+	double snapshotUs = (double)(clock() - start) / CLOCKS_PER_SEC * 1e6;
+
+	int clones = 0;
+	start = clock();
+	do
+	{
+		VM vm;
+		InitVMFromSnapshot(&vm, &snapshot);
+		FreeVM(&vm);
+		clones++;
+		elapsed = clock() - start;
+	} while (elapsed < CLOCKS_PER_SEC);
+	double cloneUs = (double)elapsed / CLOCKS_PER_SEC * 1e6 / clones;
+
+	printf("run prelude: %.1f us per start, snapshot: %.1f us once, clone: %.2f us per start (%.0fx)\n", coldUs,
+		snapshotUs, cloneUs, coldUs / cloneUs);
+
+	FreeSnapshot(&snapshot);
+	free(source);
+}
+
+// Frees and allocates blocks through reallocate() at random, keeping ALLOC_SLOTS of them live, and reports the 
+// cost per allocation. Most blocks are sized like short strings and the other objects, a few are bigger arrays.
+#define ALLOC_SLOTS 100000
+#define ALLOC_OPERATIONS 20000000
+
+static size_t RandomBlockSize(uint32_t random)
+{
+	switch (random % 16)
+	{
+	case 0: return sizeof(ObjFunction);
+	case 1: return sizeof(ObjRope);
+	case 2: return sizeof(Value) * (8 << (random >> 4) % 4); // value arrays of 8 to 64 entries
+	default: return STRING_SIZE((random >> 4) % 64);
+	}
+}
+
+static void BenchmarkAlloc(VM* vm)
+{
+	void** blocks = (void**)malloc(sizeof(void*) * ALLOC_SLOTS);
+	size_t* sizes = (size_t*)malloc(sizeof(size_t) * ALLOC_SLOTS);
+	if (blocks == NULL || sizes == NULL) exit(1);
+
+	uint32_t random = 2463534242u;
+	for (int i = 0; i < ALLOC_SLOTS; i++)
+	{
+		random ^= random << 13; random ^= random >> 17; random ^= random << 5;
+		sizes[i] = RandomBlockSize(random);
+		blocks[i] = reallocate(vm, NULL, 0, sizes[i]);
+	}
+
+	clock_t start = clock();
+	for (int i = 0; i < ALLOC_OPERATIONS; i++)
+	{
+		random ^= random << 13; random ^= random >> 17; random ^= random << 5;
+		int slot = (int)(random % ALLOC_SLOTS);
+		reallocate(vm, blocks[slot], sizes[slot], 0);
+		sizes[slot] = RandomBlockSize(random >> 8);
+		blocks[slot] = reallocate(vm, NULL, 0, sizes[slot]);
+		((char*)blocks[slot])[0] = (char)i; // touch it like a real object would
+	}
+	double nanoseconds = NanosecondsPerOp(start, ALLOC_OPERATIONS);
+
+	printf("%d free + allocate pairs with %d blocks live: %.1f ns per pair\n", ALLOC_OPERATIONS, ALLOC_SLOTS,
+		nanoseconds);
+	PrintAllocatorStats(vm);
+
+	for (int i = 0; i < ALLOC_SLOTS; i++) reallocate(vm, blocks[i], sizes[i], 0);
+	free(blocks);
+	free(sizes);
+}
+
+// Runs a short script BENCH_JOBS times on worker pools of 1 to 'maxWorkers' threads, compiling it only once, and 
+// reports the throughput of each pool against the single thread one.
+#define BENCH_JOBS 100000
+
+static double WallSeconds()
+{
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return (double)now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void BenchmarkWorkers(int maxWorkers)
+{
+	static const char* source =
+		"fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }\n"
+		"var total = 0;\n"
+		"for (var i = 0; i < 10; i++) { total = total + fib(8); }\n"
+		"var label = \"total\" + \": \" + \"done\";\n";
+
+	Program program;
+	if (!CompileProgram(&program, source)) exit(65);
+
+	Job* jobs = (Job*)malloc(sizeof(Job) * BENCH_JOBS);
+	if (jobs == NULL) exit(1);
+
+	// 1, 2, 4, ... workers, and 'maxWorkers' itself last.
+	double singleRate = 0;
+	int workerCount = 1;
+	while (true)
+	{
+		WorkerPool pool;
+		if (!InitWorkerPool(&pool, &program, workerCount, 1024))
+		{
+			fprintf(stderr, "Could not start %d workers.\n", workerCount);
+			exit(70);
+		}
+
+		double start = WallSeconds();
+		for (int i = 0; i < BENCH_JOBS; i++)
+		{
+			while (!SubmitJob(&pool, &jobs[i])) thrd_yield();
+		}
+		WaitForJobs(&pool);
+		double seconds = WallSeconds() - start;
+		FreeWorkerPool(&pool);
+
+		int failed = 0;
+		for (int i = 0; i < BENCH_JOBS; i++) failed += jobs[i].result != INTERPRET_OK;
+
+		double rate = BENCH_JOBS / seconds;
+		if (workerCount == 1) singleRate = rate;
+		printf("%3d workers: %d jobs in %.3fs, %8.0f jobs/s, %.2fx (%d failed)\n", workerCount, BENCH_JOBS, seconds,
+			rate, rate / singleRate, failed);
+
+		if (workerCount == maxWorkers) break;
+		workerCount = workerCount * 2 < maxWorkers ? workerCount * 2 : maxWorkers;
+	}
+
+	free(jobs);
+	FreeProgram(&program);
+}
+
+// Parses a byte count like "512K", "256M" or "1G". Returns 0 if it isn't one.
+static size_t ParseSize(const char* text)
+{
+	char* end;
+	unsigned long long size = strtoull(text, &end, 10);
+	switch (*end)
+	{
+	case 'K': case 'k': size <<= 10; end++; break;
+	case 'M': case 'm': size <<= 20; end++; break;
+	case 'G': case 'g': size <<= 30; end++; break;
+	default: break;
+	}
+	return *end == '\0' && end != text ? (size_t)size : 0;
+}
+
 int main(int argc, const char* argv[])
 {
-	InitVM();
+	VM vm;
+	InitVM(&vm);
 	
 	if (argc == 1)
 	{
-		REPL();
+		REPL(&vm);
+	}
+	else if (argc == 2 && strcmp(argv[1], "--bench-table") == 0)
+	{
+		BenchmarkTable(&vm);
+	}
+	else if (argc == 2 && strcmp(argv[1], "--bench-hash") == 0)
+	{
+		BenchmarkHash();
+	}
+	else if (argc == 2 && strcmp(argv[1], "--bench-concat") == 0)
+	{
+		BenchmarkConcat(&vm);
+	}
+	else if (argc == 2 && strcmp(argv[1], "--bench-call") == 0)
+	{
+		BenchmarkCall(&vm);
+	}
+	else if (argc == 2 && strcmp(argv[1], "--bench-alloc") == 0)
+	{
+		BenchmarkAlloc(&vm);
 	}
 	else if (argc == 2)
 	{
-		RunFile(argv[1]);
+		RunFile(&vm, argv[1], false, false);
+	}
+	else if (argc == 3 && strcmp(argv[1], "--bench-scanner") == 0)
+	{
+		BenchmarkScanner(argv[2]);
+	}
+	else if (argc == 3 && strcmp(argv[1], "--bench-compiler") == 0)
+	{
+		BenchmarkCompiler(&vm, argv[2]);
+	}
+	else if (argc == 3 && strcmp(argv[1], "--bench-workers") == 0 && atoi(argv[2]) > 0)
+	{
+		BenchmarkWorkers(atoi(argv[2]));
+	}
+	else if (argc == 3 && strcmp(argv[1], "--bench-snapshot") == 0)
+	{
+		BenchmarkSnapshot(argv[2]);
+	}
+	else if (argc == 3 && strcmp(argv[1], "--gc-stats") == 0)
+	{
+		RunFile(&vm, argv[2], true, false);
+	}
+	else if (argc == 3 && strcmp(argv[1], "--mem-stats") == 0)
+	{
+		RunFile(&vm, argv[2], false, true);
+	}
+	else if (argc == 4 && strcmp(argv[1], "--max-heap") == 0 && ParseSize(argv[2]) != 0)
+	{
+		vm.maxHeap = ParseSize(argv[2]);
+		RunFile(&vm, argv[3], false, false);
+	}
+	else if (argc == 4 && strcmp(argv[1], "--gc-incremental") == 0)
+	{
+		vm.incrementalGC = true;
+		vm.gcSliceWork = atoi(argv[2]);
+		if (vm.gcSliceWork < 1) vm.gcSliceWork = 1;
+		RunFile(&vm, argv[3], true, false);
 	}
 	else
 	{
-		fprintf(stderr, "Usage: clox [path]\n");
+		fprintf(stderr, "Usage: clox [path]\n       clox --bench-scanner path\n       clox --bench-compiler path\n       clox --bench-table\n       clox --bench-hash\n       clox --bench-concat\n       clox --bench-call\n       clox --bench-alloc\n       clox --bench-workers threads\n       clox --bench-snapshot path\n       clox --gc-stats path\n       clox --mem-stats path\n       clox --max-heap size path\n       clox --gc-incremental budget path\n");
 		exit(64);
 	}
 
-	FreeVM();
+	FreeVM(&vm);
 	return 0;
 }
\ No newline at end of file
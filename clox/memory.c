@@ -1,43 +1,714 @@
 #include "memory.h"
 
+#include "compiler.h"
 #include "vm.h"
 
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
-void* reallocate(void* arr, size_t old_size, size_t new_size)
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_MIN_HEAP (1024 * 1024)
+#define NURSERY_SIZE (256 * 1024) // bytes of new objects between minor collections
+#define GC_SLICE_BYTES (64 * 1024) // bytes the program may allocate between two incremental slices
+
+#ifdef DEBUG_STRESS_GC
+#define STRESS_MAJOR_INTERVAL 16 // stress mode does a minor collection per allocation and a major one every so often
+#endif
+
+static void BeginIncrementalCycle(VM* vm);
+
+#ifdef POOL_ALLOCATOR
+/*
+	Size-class allocator for small blocks. Requests up to POOL_MAX_SIZE bytes are rounded up to a multiple of 
+	POOL_GRANULE and served from that class's free list, or carved off the newest slab when the list is empty. 
+	Objects, short strings and the first few capacities of every array are small, so most allocations never reach 
+	malloc. reallocate() is always told the old size, so blocks need no header. Slabs are only given back to 
+	malloc by FreeObjects().
+*/
+
+#define POOL_SLAB_SIZE (64 * 1024)
+#define SIZE_CLASS(size) (((size) - 1) / POOL_GRANULE)
+
+static void* PoolAllocate(VM* vm, size_t size)
+{
+	int sizeClass = SIZE_CLASS(size);
+	size_t blockSize = (size_t)(sizeClass + 1) * POOL_GRANULE;
+	vm->pool.liveBytes += blockSize;
+
+	PoolBlock* block = vm->pool.freeLists[sizeClass];
+	if (block != NULL)
+	{
+		vm->pool.freeLists[sizeClass] = block->next;
+		vm->pool.freeBytes -= blockSize;
+		return block;
+	}
+
+	if ((size_t)(vm->pool.bumpEnd - vm->pool.bump) < blockSize)
+	{
+		// The rest of the old slab, less than POOL_MAX_SIZE bytes, is given up.
+		PoolBlock* slab = (PoolBlock*)malloc(POOL_SLAB_SIZE);
+		if (slab == NULL)
+		{
+			vm->pool.liveBytes -= blockSize;
+			return NULL; // reallocate() collects and tries again
+		}
+		slab->next = vm->pool.slabs;
+		vm->pool.slabs = slab;
+		vm->pool.slabCount++;
+		vm->pool.bump = (char*)slab + POOL_GRANULE; // keeps blocks POOL_GRANULE aligned
+		vm->pool.bumpEnd = (char*)slab + POOL_SLAB_SIZE;
+	}
+	void* result = vm->pool.bump;
+	vm->pool.bump += blockSize;
+	return result;
+}
+
+static void PoolFree(VM* vm, void* pointer, size_t size)
+{
+	int sizeClass = SIZE_CLASS(size);
+	size_t blockSize = (size_t)(sizeClass + 1) * POOL_GRANULE;
+	vm->pool.liveBytes -= blockSize;
+	vm->pool.freeBytes += blockSize;
+
+	PoolBlock* block = (PoolBlock*)pointer;
+	block->next = vm->pool.freeLists[sizeClass];
+	vm->pool.freeLists[sizeClass] = block;
+}
+
+static void FreePool(VM* vm)
+{
+	while (vm->pool.slabs != NULL)
+	{
+		PoolBlock* slab = vm->pool.slabs;
+		vm->pool.slabs = slab->next;
+		free(slab);
+	}
+	memset(&vm->pool, 0, sizeof(Pool));
+}
+
+// Moves the block between the pool and malloc when its size crosses POOL_MAX_SIZE or its size class changes.
+static void* ResizeBlock(VM* vm, void* pointer, size_t oldSize, size_t newSize)
+{
+	bool oldPooled = pointer != NULL && oldSize <= POOL_MAX_SIZE;
+	bool newPooled = newSize <= POOL_MAX_SIZE;
+	if (!oldPooled && !newPooled) return realloc(pointer, newSize);
+	if (oldPooled && newPooled && SIZE_CLASS(oldSize) == SIZE_CLASS(newSize)) return pointer;
+
+	void* block = newPooled ? PoolAllocate(vm, newSize) : malloc(newSize);
+	if (block == NULL) return NULL;
+	if (pointer != NULL)
+	{
+		memcpy(block, pointer, oldSize < newSize ? oldSize : newSize);
+		if (oldPooled) PoolFree(vm, pointer, oldSize);
+		else free(pointer);
+	}
+	return block;
+}
+#endif
+
+// Gives the heap reserve back to malloc so the allocation that ran out can go through, and has the VM stop the 
+// script at its next check. Returns false if the reserve is already gone.
+static bool ReleaseReserve(VM* vm)
+{
+	vm->heapExhausted = true;
+	if (vm->reserve == NULL) return false;
+
+	free(vm->reserve);
+	vm->reserve = NULL;
+	return true;
+}
+
+// Only reached when even the reserve didn't make enough room. Callers can't take NULL, there's no way to go on.
+static void OutOfMemory()
+{
+	fprintf(stderr, "Out of memory.\n");
+	exit(1);
+}
+
+// realloc() for the collector's own arrays, which can't start a collection to make room.
+static void* ReallocOrRelease(VM* vm, void* pointer, size_t size)
+{
+	void* result = realloc(pointer, size);
+	if (result == NULL && ReleaseReserve(vm)) result = realloc(pointer, size);
+	if (result == NULL) OutOfMemory();
+	return result;
+}
+
+void RecoverHeap(VM* vm)
+{
+	vm->heapExhausted = false;
+	if (vm->reserve == NULL) vm->reserve = malloc(HEAP_RESERVE_SIZE);
+}
+
+static void StartMajorCollection(VM* vm)
+{
+	if (vm->incrementalGC) BeginIncrementalCycle(vm);
+	else CollectGarbage(vm);
+}
+
+static void* ResizeOrNull(VM* vm, void* pointer, size_t oldSize, size_t newSize)
+{
+#ifdef POOL_ALLOCATOR
+	return ResizeBlock(vm, pointer, oldSize, newSize);
+#else
+	return realloc(pointer, newSize);
+#endif
+}
+
+void* reallocate(VM* vm, void* arr, size_t old_size, size_t new_size)
+{
+	vm->bytesAllocated += new_size - old_size;
+	if (new_size > old_size)
+	{
+		if (vm->bytesAllocated > vm->memStats.peakBytes) vm->memStats.peakBytes = vm->bytesAllocated;
+		if (arr == NULL) vm->memStats.allocations++;
+#ifdef DEBUG_STRESS_GC
+		if (vm->gcPhase != GC_IDLE)
+		{
+			CollectNursery(vm);
+			CollectSlice(vm);
+		}
+		else if (++vm->stressCollections % STRESS_MAJOR_INTERVAL == 0) StartMajorCollection(vm);
+		else CollectNursery(vm);
+#else
+		if (vm->gcPhase != GC_IDLE && vm->bytesAllocated > vm->nextSlice) CollectSlice(vm);
+		else if (vm->gcPhase == GC_IDLE && vm->bytesAllocated > vm->nextGC) StartMajorCollection(vm);
+		else if (vm->nurseryBytes > NURSERY_SIZE) CollectNursery(vm);
+#endif
+
+		// The allocation goes through even if the heap stays over the limit, so nothing is left half done. The VM 
+		// raises the error at its next check, see vm->heapExhausted.
+		if (vm->bytesAllocated > vm->maxHeap && !vm->heapExhausted)
+		{
+			CollectGarbage(vm);
+			if (vm->bytesAllocated > vm->maxHeap) vm->heapExhausted = true;
+		}
+	}
+
+	if (new_size == 0)
+	{
+#ifdef POOL_ALLOCATOR
+		if (arr != NULL && old_size <= POOL_MAX_SIZE) PoolFree(vm, arr, old_size);
+		else free(arr);
+#else
+		free(arr);
+#endif
+		return NULL;
+	}
+
+	void* new_arr = ResizeOrNull(vm, arr, old_size, new_size);
+	if (new_arr == NULL)
+	{
+		// Freeing the garbage may make enough room, otherwise the reserve goes and the script gets stopped.
+		CollectGarbage(vm);
+		new_arr = ResizeOrNull(vm, arr, old_size, new_size);
+		if (new_arr == NULL && ReleaseReserve(vm)) new_arr = ResizeOrNull(vm, arr, old_size, new_size);
+		if (new_arr == NULL) OutOfMemory();
+	}
+	return new_arr;
+}
+
+// Appends to an array of object pointers owned by the collector. These use plain realloc so growing them never
+// starts a collection.
+static void AppendObject(VM* vm, Obj*** array, int* count, int* capacity, Obj* object)
+{
+	if (*count >= *capacity)
+	{
+		*capacity = GROW_CAPACITY(*capacity);
+		*array = (Obj**)ReallocOrRelease(vm, *array, sizeof(Obj*) * (*capacity));
+	}
+	(*array)[(*count)++] = object;
+}
+
+void MarkObject(VM* vm, Obj* object)
+{
+	if (object == NULL || object->isMarked) return;
+	// A minor collection only traces young objects. Old ones are assumed to be alive, the remembered set 
+	// covers the young objects they point at. A major collection only traces old objects, the young ones are 
+	// promoted wholesale before it finishes marking.
+	if (object->isOld == vm->collectingNursery) return;
+	object->isMarked = true;
+
+	// Strings and natives don't refer to other objects, there's no point putting them on the gray stack.
+	if (object->type == OBJ_STRING || object->type == OBJ_NATIVE) return;
+
+	AppendObject(vm, &vm->grayStack, &vm->grayCount, &vm->grayCapacity, object);
+}
+
+void MarkValue(VM* vm, Value value)
+{
+	if (IS_OBJ(value)) MarkObject(vm, AS_OBJ(value));
+}
+
+void RememberObject(VM* vm, Obj* object)
+{
+	object->isRemembered = true;
+	AppendObject(vm, &vm->remembered, &vm->rememberedCount, &vm->rememberedCapacity, object);
+}
+
+void WriteBarrier(VM* vm, Obj* object, Value value)
+{
+	if (!IS_OBJ(value)) return;
+	Obj* target = AS_OBJ(value);
+
+	if (vm->gcPhase == GC_MARKING && object->isMarked) MarkObject(vm, target); // does nothing for young targets
+	if (object->isOld && !object->isRemembered && !target->isOld) RememberObject(vm, object);
+}
+
+static void MarkArray(VM* vm, ValueArray* array)
+{
+	for (int i = 0; i < array->count; i++) MarkValue(vm, array->values[i]);
+}
+
+static void BlackenObject(VM* vm, Obj* object)
+{
+	switch (object->type)
+	{
+	case OBJ_FUNCTION:
+	{
+		ObjFunction* function = (ObjFunction*)object;
+		MarkObject(vm, (Obj*)function->name);
+		MarkArray(vm, &function->chunk.constants);
+		break;
+	}
+	case OBJ_ROPE:
+	{
+		ObjRope* rope = (ObjRope*)object;
+		MarkObject(vm, rope->left);
+		MarkObject(vm, rope->right);
+		MarkObject(vm, (Obj*)rope->flat);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+static void MarkRoots(VM* vm)
+{
+	for (int i = 0; i < vm->stack.count; i++) MarkValue(vm, vm->stack.values[i]);
+	MarkValue(vm, vm->pushing);
+	for (int i = 0; i < vm->frameCount; i++) MarkObject(vm, (Obj*)vm->frames[i].function);
+	MarkCompilerRoots(vm);
+
+	if (!vm->collectingNursery || vm->globalsHaveYoung) MarkTable(vm, &vm->globals);
+	if (vm->collectingNursery)
+	{
+		for (int i = 0; i < vm->rememberedCount; i++) BlackenObject(vm, vm->remembered[i]);
+	}
+}
+
+// Blackens gray objects until only the bottom 'floor' ones are left.
+static void TraceReferences(VM* vm, int floor)
+{
+	while (vm->grayCount > floor)
+	{
+		BlackenObject(vm, vm->grayStack[--vm->grayCount]);
+	}
+}
+
+// While a major collection is marking, promoted objects are black and the collection traces what they point 
+// at. While it's sweeping they go behind the sweep cursor.
+static void PromoteObject(VM* vm, Obj* object)
+{
+	if (vm->gcPhase == GC_MARKING) MarkObject(vm, object);
+	object->isOld = true;
+	SetObjNext(object, vm->objects);
+	vm->objects = object;
+	if (vm->gcPhase == GC_SWEEPING && vm->sweepCursor == NULL) vm->sweepCursor = object;
+}
+
+// Frees the unmarked objects in 'list' and clears the marks of the rest. Survivors of a young list are promoted
+// onto vm->objects.
+static void SweepList(VM* vm, Obj** list, bool promote)
+{
+	Obj* object = *list;
+	*list = NULL;
+	while (object != NULL)
+	{
+		Obj* next = ObjNext(object);
+		if (object->isMarked)
+		{
+			object->isMarked = false;
+			if (promote)
+			{
+				PromoteObject(vm, object);
+			}
+			else
+			{
+				SetObjNext(object, *list);
+				*list = object;
+			}
+		}
+		else
+		{
+			FreeObject(vm, object);
+		}
+		object = next;
+	}
+}
+
+// Every survivor is old afterwards, so no old object can point at a young one any more.
+static void ForgetRemembered(VM* vm)
+{
+	for (int i = 0; i < vm->rememberedCount; i++) vm->remembered[i]->isRemembered = false;
+	vm->rememberedCount = 0;
+	vm->globalsHaveYoung = false;
+	vm->nurseryBytes = 0;
+}
+
+static uint64_t NowNanoseconds()
+{
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void RecordPause(VM* vm, PauseHistogram* histogram, uint64_t nanoseconds)
+{
+	int bucket = 0;
+	for (uint64_t micros = nanoseconds / 1000; micros > 1 && bucket < GC_PAUSE_BUCKETS - 1; micros >>= 1) bucket++;
+
+	if (histogram->count >= histogram->samplesCapacity)
+	{
+		histogram->samplesCapacity = GROW_CAPACITY(histogram->samplesCapacity);
+		histogram->samples = (uint64_t*)ReallocOrRelease(vm, histogram->samples, 
+			sizeof(uint64_t) * histogram->samplesCapacity);
+	}
+	histogram->samples[histogram->count] = nanoseconds;
+
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->totalNs += nanoseconds;
+	if (nanoseconds > histogram->maxNs) histogram->maxNs = nanoseconds;
+}
+
+void CollectNursery(VM* vm)
+{
+#ifdef DEBUG_LOG_GC
+	printf("-- minor gc begin\n");
+	size_t before = vm->bytesAllocated;
+#endif
+	uint64_t start = NowNanoseconds();
+
+	int majorGrayCount = vm->grayCount; // left for a running incremental cycle
+	vm->collectingNursery = true;
+	MarkRoots(vm);
+	TraceReferences(vm, majorGrayCount);
+	TableRemoveWhite(&vm->strings, true);
+	SweepList(vm, &vm->youngObjects, true);
+	vm->collectingNursery = false;
+	ForgetRemembered(vm);
+
+	RecordPause(vm, &vm->minorPauses, NowNanoseconds() - start);
+
+#ifdef DEBUG_LOG_GC
+	printf("-- minor gc end, collected %zu bytes (from %zu to %zu)\n", before - vm->bytesAllocated, before,
+		vm->bytesAllocated);
+#endif
+}
+
+// Moves the young objects onto vm->objects. When a major collection starts they are swept with the rest. Once it 
+// has marked everything else they are kept alive, they can refer to old objects no root reaches any more.
+static void SpliceYoungObjects(VM* vm, bool black)
+{
+	while (vm->youngObjects != NULL)
+	{
+		Obj* object = vm->youngObjects;
+		vm->youngObjects = ObjNext(object);
+		object->isOld = true;
+		SetObjNext(object, vm->objects);
+		vm->objects = object;
+		if (black) MarkObject(vm, object);
+	}
+	ForgetRemembered(vm);
+}
+
+static void FinishMarking(VM* vm)
+{
+	MarkRoots(vm);
+	SpliceYoungObjects(vm, true);
+	TraceReferences(vm, 0);
+	TableRemoveWhite(&vm->strings, false);
+	vm->gcPhase = GC_SWEEPING;
+	vm->sweepCursor = NULL;
+}
+
+static Obj* NextToSweep(VM* vm)
+{
+	return vm->sweepCursor == NULL ? vm->objects : ObjNext(vm->sweepCursor);
+}
+
+// Sweeps up to 'budget' objects. Objects promoted during the sweep are put behind the cursor.
+static bool SweepSlice(VM* vm, int budget)
+{
+	Obj* object;
+	while ((object = NextToSweep(vm)) != NULL && budget-- > 0)
+	{
+		if (object->isMarked)
+		{
+			object->isMarked = false;
+			vm->sweepCursor = object;
+		}
+		else
+		{
+			if (vm->sweepCursor == NULL) vm->objects = ObjNext(object);
+			else SetObjNext(vm->sweepCursor, ObjNext(object));
+			FreeObject(vm, object);
+		}
+	}
+	return object == NULL;
+}
+
+static void FinishCycle(VM* vm)
+{
+	vm->gcPhase = GC_IDLE;
+	vm->sweepCursor = NULL;
+	vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+	if (vm->nextGC < GC_MIN_HEAP) vm->nextGC = GC_MIN_HEAP;
+}
+
+void CollectGarbage(VM* vm)
+{
+#ifdef DEBUG_LOG_GC
+	printf("-- gc begin\n");
+	size_t before = vm->bytesAllocated;
+#endif
+	uint64_t start = NowNanoseconds();
+
+	if (vm->gcPhase == GC_IDLE)
+	{
+		SpliceYoungObjects(vm, false);
+		vm->gcPhase = GC_MARKING;
+	}
+	if (vm->gcPhase == GC_MARKING) FinishMarking(vm);
+	SweepSlice(vm, INT_MAX);
+	FinishCycle(vm);
+
+	RecordPause(vm, &vm->majorPauses, NowNanoseconds() - start);
+
+#ifdef DEBUG_LOG_GC
+	printf("-- gc end, collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm->bytesAllocated, before,
+		vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
+/*
+	Incremental major collection. The cycle starts by graying the roots, then every GC_SLICE_BYTES of allocation 
+	it blackens up to vm->gcSliceWork gray objects. WriteBarrier() grays old objects stored into marked ones, so no 
+	black object ever points at a white one. Minor collections keep running in between, the objects they promote 
+	are black. The roots aren't behind a barrier and neither are young objects, so when the gray stack runs dry 
+	the roots are scanned once more and the young objects are promoted black. After that the heap is swept 
+	vm->gcSliceWork objects at a time.
+*/
+
+static void BeginIncrementalCycle(VM* vm)
+{
+#ifdef DEBUG_LOG_GC
+	printf("-- incremental gc begin\n");
+#endif
+	uint64_t start = NowNanoseconds();
+
+	SpliceYoungObjects(vm, false);
+	vm->gcPhase = GC_MARKING;
+	MarkRoots(vm);
+	vm->nextSlice = vm->bytesAllocated + GC_SLICE_BYTES;
+
+	RecordPause(vm, &vm->majorPauses, NowNanoseconds() - start);
+}
+
+void CollectSlice(VM* vm)
+{
+	uint64_t start = NowNanoseconds();
+
+	if (vm->gcPhase == GC_MARKING)
+	{
+		int budget = vm->gcSliceWork;
+		while (vm->grayCount > 0 && budget-- > 0)
+		{
+			BlackenObject(vm, vm->grayStack[--vm->grayCount]);
+		}
+
+		if (vm->grayCount == 0) FinishMarking(vm);
+	}
+	else if (SweepSlice(vm, vm->gcSliceWork))
+	{
+		FinishCycle(vm);
+#ifdef DEBUG_LOG_GC
+		printf("-- incremental gc end, %zu bytes in use, next at %zu\n", vm->bytesAllocated, vm->nextGC);
+#endif
+	}
+	vm->nextSlice = vm->bytesAllocated + GC_SLICE_BYTES;
+
+	RecordPause(vm, &vm->majorPauses, NowNanoseconds() - start);
+}
+
+static int CompareSamples(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+// Sorts the samples in place.
+static double Percentile(uint64_t* samples, int count, double percent)
+{
+	if (count == 0) return 0;
+	qsort(samples, count, sizeof(uint64_t), CompareSamples);
+	int index = (int)(count * percent / 100.0 + 0.999999) - 1;
+	return (double)samples[index < 0 ? 0 : index];
+}
+
+static void PrintPauseHistogram(const char* name, PauseHistogram* histogram)
 {
-    if (new_size == 0)
-    {
-        free(arr);
-        return NULL;
-    }
+	printf("%s pauses: %d, total %.3f ms, mean %.1f us, p99 %.1f us, max %.1f us\n", name, histogram->count,
+		histogram->totalNs / 1e6, histogram->count > 0 ? histogram->totalNs / 1e3 / histogram->count : 0.0,
+		Percentile(histogram->samples, histogram->count, 99) / 1e3, histogram->maxNs / 1e3);
+
+	for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+	{
+		if (histogram->buckets[i] == 0) continue;
+		if (i == 0) printf("  %10s < 2 us: %d\n", "", histogram->buckets[i]);
+		else printf("  %7llu - %llu us: %d\n", 1ull << i, 1ull << (i + 1), histogram->buckets[i]);
+	}
+}
+
+void PrintGCStats(VM* vm)
+{
+	PrintPauseHistogram("minor", &vm->minorPauses);
+	PrintPauseHistogram(vm->incrementalGC ? "major (incremental slices)" : "major", &vm->majorPauses);
+
+	int count = vm->minorPauses.count + vm->majorPauses.count;
+	uint64_t* all = (uint64_t*)ReallocOrRelease(vm, NULL, sizeof(uint64_t) * (count > 0 ? count : 1));
+	if (vm->minorPauses.count > 0) memcpy(all, vm->minorPauses.samples, sizeof(uint64_t) * vm->minorPauses.count);
+	if (vm->majorPauses.count > 0) 
+	{
+		memcpy(all + vm->minorPauses.count, vm->majorPauses.samples, sizeof(uint64_t) * vm->majorPauses.count);
+	}
+	uint64_t max = vm->minorPauses.maxNs > vm->majorPauses.maxNs ? vm->minorPauses.maxNs : vm->majorPauses.maxNs;
+	printf("all pauses: p99 %.1f us, max %.1f us\n", Percentile(all, count, 99) / 1e3, max / 1e3);
+	free(all);
+	PrintAllocatorStats(vm);
+}
 
-    void* new_arr = realloc(arr, new_size);
-    if (new_arr == NULL) exit(1);
-    return new_arr;
+void PrintAllocatorStats(VM* vm)
+{
+#ifdef POOL_ALLOCATOR
+	size_t slabBytes = (size_t)vm->pool.slabCount * POOL_SLAB_SIZE;
+	size_t unusedBytes = slabBytes - vm->pool.liveBytes - vm->pool.freeBytes;
+	printf("pool: %d slabs, %.1f KB live, %.1f KB on free lists, %.1f KB unused, %.1f%% of slab bytes live\n",
+		vm->pool.slabCount, vm->pool.liveBytes / 1024.0, vm->pool.freeBytes / 1024.0, unusedBytes / 1024.0,
+		slabBytes > 0 ? 100.0 * vm->pool.liveBytes / slabBytes : 100.0);
+#else
+	printf("pool: disabled, every block comes from malloc\n");
+#endif
+	printf("heap: %.1f KB in use\n", vm->bytesAllocated / 1024.0);
 }
 
-void FreeObject(Obj* obj)
+static size_t ObjectSize(Obj* obj)
 {
+	switch (obj->type)
+	{
+	case OBJ_FUNCTION: return sizeof(ObjFunction);
+	case OBJ_STRING: return STRING_SIZE(((ObjString*)obj)->length);
+	case OBJ_ROPE: return sizeof(ObjRope);
+	case OBJ_NATIVE: return sizeof(ObjNative);
+	default: return 0;
+	}
+}
+
+typedef struct
+{
+	const char* name;
+	double value;
+} MemStat;
+
+#define MEM_STAT_MAX 32
+
+#define ADD_STAT(statName, statValue) \
+	do { stats[count].name = (statName); stats[count].value = (double)(statValue); count++; } while (false)
+
+static int ListMemStats(VM* vm, MemStat* stats)
+{
+	static const char* objectStatNames[OBJ_TYPE_COUNT][3] = {
+		{ "nativeAllocated", "nativeCount", "nativeBytes" },
+		{ "functionAllocated", "functionCount", "functionBytes" },
+		{ "stringAllocated", "stringCount", "stringBytes" },
+		{ "ropeAllocated", "ropeCount", "ropeBytes" },
+	};
+
+	int count = 0;
+	ADD_STAT("bytes", vm->bytesAllocated);
+	ADD_STAT("peakBytes", vm->memStats.peakBytes);
+	ADD_STAT("allocations", vm->memStats.allocations);
+	ADD_STAT("chunkBytes", vm->memStats.chunkBytes);
+	ADD_STAT("tableBytes", vm->memStats.tableBytes);
+	ADD_STAT("internCount", vm->strings.count);
+	ADD_STAT("internTombstones", vm->strings.tombstones);
+	ADD_STAT("internCapacity", vm->strings.capacity);
+	for (int type = 0; type < OBJ_TYPE_COUNT; type++)
+	{
+		ADD_STAT(objectStatNames[type][0], vm->memStats.objectsAllocated[type]);
+		ADD_STAT(objectStatNames[type][1], vm->memStats.objectCount[type]);
+		ADD_STAT(objectStatNames[type][2], vm->memStats.objectBytes[type]);
+	}
+	return count;
+}
+
+void PrintMemStats(VM* vm)
+{
+	MemStat stats[MEM_STAT_MAX];
+	int count = ListMemStats(vm, stats);
+	for (int i = 0; i < count; i++) printf("%s: %.0f\n", stats[i].name, stats[i].value);
+}
+
+bool GetMemStat(VM* vm, const char* name, double* value)
+{
+	MemStat stats[MEM_STAT_MAX];
+	int count = ListMemStats(vm, stats);
+	for (int i = 0; i < count; i++)
+	{
+		if (strcmp(stats[i].name, name) == 0)
+		{
+			*value = stats[i].value;
+			return true;
+		}
+	}
+	return false;
+}
+
+void FreeObject(VM* vm, Obj* obj)
+{
+	vm->memStats.objectCount[obj->type]--;
+	vm->memStats.objectBytes[obj->type] -= ObjectSize(obj);
+
 	switch (obj->type)
 	{
 	case OBJ_FUNCTION:
 	{
 		ObjFunction* func = (ObjFunction*)obj;
-		FreeChunk(&func->chunk);
+		FreeChunk(vm, &func->chunk);
 		// FreeObject(func->name); garbage collector will deal with this later.
-		FREE(ObjFunction, func);
+		FREE(vm, ObjFunction, func);
 		break;
 	}
 	case OBJ_STRING: {
 		ObjString* objString = (ObjString*)obj;
-		FREE_ARRAY(char, objString->chars, objString->length + 1);
-		FREE(ObjString, objString);
+		reallocate(vm, objString, STRING_SIZE(objString->length), 0);
 		break;
 	}
-	case OBJ_NATIVE: 
+	case OBJ_ROPE:
 	{
-		FREE(ObjNative, obj);
+		FREE(vm, ObjRope, obj);
+		break;
+	}
+	case OBJ_NATIVE:
+	{
+		FREE(vm, ObjNative, obj);
 		break;
 	}
 	default:
@@ -45,13 +716,45 @@ void FreeObject(Obj* obj)
 	}
 }
 
-void FreeObjects()
+static void FreezeList(Obj* object)
+{
+	for (; object != NULL; object = ObjNext(object))
+	{
+		object->isMarked = true;
+		object->isOld = true;
+	}
+}
+
+void FreezeObjects(VM* vm)
+{
+	assert(vm->gcPhase == GC_IDLE && "Can't freeze in the middle of a collection.");
+	FreezeList(vm->objects);
+	FreezeList(vm->youngObjects);
+}
+
+static void FreeList(VM* vm, Obj* object)
 {
-	Obj* object = vm.objects;
 	while (object != NULL)
 	{
 		Obj* toFree = object;
-		object = object->next;
-		FreeObject(toFree);
+		object = ObjNext(object);
+		FreeObject(vm, toFree);
 	}
+}
+
+void FreeObjects(VM* vm)
+{
+	FreeList(vm, vm->objects);
+	FreeList(vm, vm->youngObjects);
+	vm->objects = vm->youngObjects = NULL;
+
+	free(vm->grayStack);
+	free(vm->remembered);
+	free(vm->minorPauses.samples);
+	free(vm->majorPauses.samples);
+	free(vm->reserve);
+	vm->reserve = NULL;
+#ifdef POOL_ALLOCATOR
+	FreePool(vm);
+#endif
 }
\ No newline at end of file
@@ -7,20 +7,108 @@
 #define GROW_CAPACITY(capacity) \
 		((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, arr, old_cap, new_cap) \
-		(type*)reallocate(arr, sizeof(type) * (old_cap), sizeof(type) * (new_cap))
+#define GROW_ARRAY(vm, type, arr, old_cap, new_cap) \
+		(type*)reallocate(vm, arr, sizeof(type) * (old_cap), sizeof(type) * (new_cap))
 
-#define FREE_ARRAY(type, arr, size) \
-		reallocate(arr, sizeof(type) * (size), 0)
+#define FREE_ARRAY(vm, type, arr, size) \
+		reallocate(vm, arr, sizeof(type) * (size), 0)
 
-#define ALLOCATE(type, count) \
-	(type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+	(type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
-#define FREE(type, object) \
-	reallocate(object, sizeof(type), 0)
+#define FREE(vm, type, object) \
+	reallocate(vm, object, sizeof(type), 0)
 
-void* reallocate(void* pointer, size_t old_size, size_t new_size);
-void FreeObject(Obj* obj);
-void FreeObjects();
+// Bucket i counts collections that took [2^i, 2^(i+1)) microseconds, bucket 0 also takes the shorter ones.
+#define GC_PAUSE_BUCKETS 24
+
+typedef struct
+{
+	int count;
+	uint64_t totalNs;
+	uint64_t maxNs;
+	int buckets[GC_PAUSE_BUCKETS];
+	uint64_t* samples; // every pause, for percentiles
+	int samplesCapacity;
+} PauseHistogram;
+
+#ifdef POOL_ALLOCATOR
+#define POOL_GRANULE 8 // nothing stored in the heap needs more alignment than a pointer
+#define POOL_MAX_SIZE 256 // bigger blocks go to malloc
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+
+typedef struct PoolBlock
+{
+	struct PoolBlock* next;
+} PoolBlock;
+
+typedef struct
+{
+	PoolBlock* freeLists[POOL_CLASSES]; // class i holds blocks of (i + 1) * POOL_GRANULE bytes
+	char* bump; // unused part of the newest slab
+	char* bumpEnd;
+	PoolBlock* slabs;
+	int slabCount;
+	size_t liveBytes; // handed out, rounded up to the size class
+	size_t freeBytes; // on the free lists
+} Pool;
+#endif
+
+// Where the heap goes. reallocate() keeps the peak and the allocation count, the rest is counted by whoever owns 
+// the memory. Compiler scratch memory comes from an arena and isn't included, see arena.h.
+typedef struct
+{
+	size_t peakBytes; // highest vm->bytesAllocated so far
+	size_t allocations; // blocks handed out by reallocate()
+	size_t objectsAllocated[OBJ_TYPE_COUNT];
+	size_t objectCount[OBJ_TYPE_COUNT]; // live, same for the bytes
+	size_t objectBytes[OBJ_TYPE_COUNT];
+	size_t chunkBytes; // code, constants and line runs of finished functions
+	size_t tableBytes; // control bytes and entries of every table
+} MemStats;
+
+// Major collections either run in one go or, with vm->incrementalGC, as a cycle of bounded slices interleaved 
+// with the program.
+typedef enum
+{
+	GC_IDLE,
+	GC_MARKING,
+	GC_SWEEPING,
+} GCPhase;
+
+// Every VM keeps this much malloc memory aside. It is given up when malloc fails even after a collection, so the
+// allocation still goes through and the script is stopped with a runtime error instead of the process exiting.
+#define HEAP_RESERVE_SIZE (64 * 1024)
+
+void* reallocate(VM* vm, void* pointer, size_t old_size, size_t new_size);
+// Clears vm->heapExhausted before the next script and sets the heap reserve aside again if it was used up.
+void RecoverHeap(VM* vm);
+void MarkObject(VM* vm, Obj* object);
+void MarkValue(VM* vm, Value value);
+void RememberObject(VM* vm, Obj* object);
+// Minor collection: only frees young objects and promotes the ones that survive.
+void CollectNursery(VM* vm);
+// Major collection of the whole heap. Finishes an incremental cycle if one is running.
+void CollectGarbage(VM* vm);
+// Does one slice of the running incremental cycle.
+void CollectSlice(VM* vm);
+void PrintGCStats(VM* vm);
+void PrintAllocatorStats(VM* vm);
+// Prints every counter GetMemStat() knows, one "name: value" per line.
+void PrintMemStats(VM* vm);
+// Looks up one of the counters printed by PrintMemStats() by name.
+bool GetMemStat(VM* vm, const char* name, double* value);
+
+// Has to be called whenever a value is stored into an object that may already be old or already be marked, 
+// before anything else gets allocated. Minor collections don't trace old objects, so the ones pointing at young 
+// objects are remembered and rescanned instead. Incremental marking doesn't scan marked objects again, so the
+// stored value is marked right away.
+void WriteBarrier(VM* vm, Obj* object, Value value);
+// Leaves every object of 'vm' marked and old for good. Collections on other VMs stop at marked objects and never
+// trace or free objects they didn't allocate, so they can refer to these without writing to them. Nothing may be
+// allocated on 'vm' afterwards, the objects are freed with it by FreeVM().
+void FreezeObjects(VM* vm);
+void FreeObject(VM* vm, Obj* obj);
+void FreeObjects(VM* vm);
 
 #endif // !clox_memory_h
@@ -0,0 +1,7 @@
+#ifndef clox_number_h
+#define clox_number_h
+
+// Converts a number literal token (digits with an optional fraction) to the closest double.
+double ParseNumber(const char* start, int length);
+
+#endif // !clox_number_h
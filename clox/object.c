@@ -4,12 +4,19 @@
 #include "vm.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
 
-#define ALLOCATE_OBJ(type, objectType) (type*)AllocateObject(sizeof(type), objectType)
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
-ObjFunction* NewFunction()
+#define ALLOCATE_OBJ(vm, type, objectType) (type*)AllocateObject(vm, sizeof(type), objectType)
+
+ObjFunction* NewFunction(VM* vm)
 {
-    ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+    ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->name = NULL;
     InitChunk(&function->chunk);
@@ -17,59 +24,157 @@ ObjFunction* NewFunction()
     return function;
 }
 
-ObjNative* NewNative(NativeFn function)
+ObjNative* NewNative(VM* vm, NativeFn function)
 {
-    ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+    ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
     return native;
 }
 
-static Obj* AllocateObject(size_t size, ObjType type)
+// Not an assert, a bad address has to be caught in release builds too. There's no way to go on without losing
+// the object.
+static void CheckObjAddress(Obj* object)
+{
+#ifdef PACKED_OBJ_HEADER
+    if (((uint64_t)(uintptr_t)object >> OBJ_LINK_BITS) != 0)
+    {
+        fprintf(stderr, "Object address %p doesn't fit in the packed object header. Build without "
+            "PACKED_OBJ_HEADER on this platform.\n", (void*)object);
+        abort();
+    }
+#endif
+}
+
+Obj* AllocateObject(VM* vm, size_t size, ObjType type)
 {
-    Obj* object = (Obj*) reallocate(NULL, 0, size);
+    Obj* object = (Obj*) reallocate(vm, NULL, 0, size);
+    CheckObjAddress(object);
     object->type = type;
-    object->next = vm.objects;
-    vm.objects = object;
+    object->isMarked = false;
+    object->isOld = false;
+    object->isRemembered = false;
+    SetObjNext(object, vm->youngObjects);
+    vm->youngObjects = object;
+    vm->nurseryBytes += size;
+    vm->memStats.objectsAllocated[type]++;
+    vm->memStats.objectCount[type]++;
+    vm->memStats.objectBytes[type] += size;
     return object;
 }
 
-static ObjString* AllocateString(char* chars, int length, uint32_t hash)
+ObjString* CopyString(VM* vm, const char* str, int length)
 {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->chars = chars;
+    uint32_t hash = HashString(str, length);
+    ObjString* interned = TableFindString(&vm->strings, str, length, hash);
+    if (interned != NULL) { return interned; }
+
+    ObjString* string = (ObjString*)AllocateObject(vm, STRING_SIZE(length), OBJ_STRING);
     string->length = length;
     string->hash = hash;
+    string->interned = true;
+    memcpy(string->chars, str, length);
+    string->chars[length] = '\0';
 
-    TableSet(&vm.strings, string, NIL_VAL);
+    // Growing the table can start a collection and vm->strings doesn't keep its keys alive.
+    Push(vm, OBJ_VAL(string));
+    TableSet(vm, &vm->strings, string, NIL_VAL);
+    Pop(vm);
 
     return string;
 }
 
-ObjString* CopyString(const char* str, int length)
+ObjString* AllocateStringBuffer(VM* vm, int length)
 {
-    uint32_t hash = HashString(str, length);
-    ObjString* interned = TableFindString(&vm.strings, str, length, hash);
-    if (interned != NULL) { return interned; }
+    ObjString* buffer = (ObjString*)reallocate(vm, NULL, 0, STRING_SIZE(length));
+    buffer->length = length;
+    buffer->chars[length] = '\0';
+    return buffer;
+}
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, str, length);
-    heapChars[length] = '\0';
+ObjString* TakeString(VM* vm, ObjString* buffer)
+{
+    CheckObjAddress(&buffer->obj);
+    buffer->obj.type = OBJ_STRING;
+    buffer->obj.isMarked = false;
+    buffer->obj.isOld = false;
+    buffer->obj.isRemembered = false;
+    SetObjNext(&buffer->obj, vm->youngObjects);
+    vm->youngObjects = (Obj*)buffer;
+    vm->nurseryBytes += STRING_SIZE(buffer->length);
+    vm->memStats.objectsAllocated[OBJ_STRING]++;
+    vm->memStats.objectCount[OBJ_STRING]++;
+    vm->memStats.objectBytes[OBJ_STRING] += STRING_SIZE(buffer->length);
+    buffer->hash = 0;
+    buffer->interned = false;
+    return buffer;
+}
 
-    return AllocateString(heapChars, length, hash);
+// A rope that has already been flattened stands in for its flat string.
+static Obj* RopeChild(Obj* string)
+{
+    if (string->type == OBJ_ROPE && ((ObjRope*)string)->flat != NULL) return (Obj*)((ObjRope*)string)->flat;
+    return string;
 }
 
-ObjString* TakeString(char* str, int length)
+ObjRope* NewRope(VM* vm, Obj* left, Obj* right)
 {
-    uint32_t hash = HashString(str, length);
+    ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+    rope->left = RopeChild(left);
+    rope->right = RopeChild(right);
+    rope->length = StringLength(left) + StringLength(right);
+    rope->flat = NULL;
+    return rope;
+}
 
-    ObjString* interned = TableFindString(&vm.strings, str, length, hash);
-    if (interned != NULL)
+ObjString* FlattenRope(VM* vm, ObjRope* rope)
+{
+    if (rope->flat != NULL) return rope->flat;
+
+    ObjString* buffer = AllocateStringBuffer(vm, rope->length);
+
+    // Fill the buffer back to front, walking right children first. Left leaning ropes, which is what 's = s + piece'
+    // builds, only ever have one pending node. The walk is iterative so deep ropes can't overflow the C stack.
+    Obj** pending = NULL;
+    int pendingCount = 0;
+    int pendingCapacity = 0;
+    int end = rope->length;
+    Obj* node = (Obj*)rope;
+    while (true)
     {
-        FREE_ARRAY(char, str, length + 1);
-        return interned;
+        node = RopeChild(node);
+        if (node->type == OBJ_STRING)
+        {
+            ObjString* piece = (ObjString*)node;
+            end -= piece->length;
+            memcpy(buffer->chars + end, piece->chars, piece->length);
+
+            if (pendingCount == 0) break;
+            node = pending[--pendingCount];
+        }
+        else
+        {
+            if (pendingCount == pendingCapacity)
+            {
+                int oldCapacity = pendingCapacity;
+                pendingCapacity = GROW_CAPACITY(oldCapacity);
+                pending = GROW_ARRAY(vm, Obj*, pending, oldCapacity, pendingCapacity);
+            }
+            pending[pendingCount++] = ((ObjRope*)node)->left;
+            node = ((ObjRope*)node)->right;
+        }
     }
+    FREE_ARRAY(vm, Obj*, pending, pendingCapacity);
 
-    return AllocateString(str, length, hash);
+    rope->flat = TakeString(vm, buffer);
+    WriteBarrier(vm, (Obj*)rope, OBJ_VAL(rope->flat));
+    rope->left = NULL;
+    rope->right = NULL;
+    return rope->flat;
+}
+
+#ifdef HASH_FNV1A
+void SeedStringHash()
+{
 }
 
 uint32_t HashString(const char* key, int length)
@@ -84,6 +189,123 @@ uint32_t HashString(const char* key, int length)
 
     return hash;
 }
+#else
+/*
+    wyhash (https://github.com/wangyi-fudan/wyhash). Reads 8 or 16 bytes per step using 64x64->128 bit 
+    multiplies to mix them in. Strings up to 16 bytes, which covers most identifiers, are hashed without a loop.
+    The seed is picked once per process so inputs that all collide can't be crafted ahead of time.
+*/
+
+static const uint64_t hashSecret[4] = { 0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull };
+static _Atomic uint64_t hashSeed = 0;
+
+// Threads that start their first VMs at the same time each pick a seed, but only the first one stored is kept.
+void SeedStringHash()
+{
+    if (atomic_load_explicit(&hashSeed, memory_order_relaxed) != 0) return;
+
+    uint64_t entropy = (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32) ^ (uint64_t)(uintptr_t)&entropy;
+    uint64_t unseeded = 0;
+    atomic_compare_exchange_strong_explicit(&hashSeed, &unseeded, entropy | 1, memory_order_relaxed,
+        memory_order_relaxed);
+}
+
+static inline void Multiply128(uint64_t* a, uint64_t* b)
+{
+#ifdef _MSC_VER
+    uint64_t high;
+    uint64_t low = _umul128(*a, *b, &high);
+    *a = low;
+    *b = high;
+#else
+    unsigned __int128 product = (unsigned __int128)*a * *b;
+    *a = (uint64_t)product;
+    *b = (uint64_t)(product >> 64);
+#endif
+}
+
+static inline uint64_t Mix(uint64_t a, uint64_t b)
+{
+    Multiply128(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t Read64(const uint8_t* p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t Read32(const uint8_t* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint32_t HashString(const char* key, int length)
+{
+    const uint8_t* p = (const uint8_t*)key;
+    size_t remaining = (size_t)length;
+    // Never changes once set, and SeedStringHash() has set it on this thread by the time a VM hashes anything.
+    uint64_t seedBits = atomic_load_explicit(&hashSeed, memory_order_relaxed);
+    uint64_t seed = seedBits ^ Mix(seedBits ^ hashSecret[0], hashSecret[1]);
+    uint64_t a, b;
+
+    if (remaining <= 16)
+    {
+        if (remaining >= 4)
+        {
+            // Two overlapping reads from each end cover every byte.
+            size_t middle = (remaining >> 3) << 2;
+            a = (Read32(p) << 32) | Read32(p + middle);
+            b = (Read32(p + remaining - 4) << 32) | Read32(p + remaining - 4 - middle);
+        }
+        else if (remaining > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[remaining >> 1] << 8) | p[remaining - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        if (remaining > 48)
+        {
+            uint64_t seed1 = seed, seed2 = seed;
+            do
+            {
+                seed = Mix(Read64(p) ^ hashSecret[1], Read64(p + 8) ^ seed);
+                seed1 = Mix(Read64(p + 16) ^ hashSecret[2], Read64(p + 24) ^ seed1);
+                seed2 = Mix(Read64(p + 32) ^ hashSecret[3], Read64(p + 40) ^ seed2);
+                p += 48;
+                remaining -= 48;
+            } while (remaining > 48);
+            seed ^= seed1 ^ seed2;
+        }
+
+        while (remaining > 16)
+        {
+            seed = Mix(Read64(p) ^ hashSecret[1], Read64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+
+        a = Read64(p + remaining - 16);
+        b = Read64(p + remaining - 8);
+    }
+
+    a ^= hashSecret[1];
+    b ^= seed;
+    Multiply128(&a, &b);
+    uint64_t hash = Mix(a ^ hashSecret[0] ^ (uint64_t)length, b ^ hashSecret[1]);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+#endif
 
 static void PrintFunction(ObjFunction* function)
 {
@@ -91,7 +313,7 @@ static void PrintFunction(ObjFunction* function)
     else printf("<fn %s>", function->name->chars);
 }
 
-void PrintObject(Value value)
+void PrintObject(VM* vm, Value value)
 {
     switch (OBJ_TYPE(value))
     {
@@ -105,6 +327,11 @@ void PrintObject(Value value)
         printf("%s", str->chars);
         break;
     }
+    case OBJ_ROPE:
+    {
+        printf("%s", FlattenRope(vm, AS_ROPE(value))->chars);
+        break;
+    }
     case OBJ_NATIVE:
     {
         printf("<native fn>");
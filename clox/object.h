@@ -5,6 +5,8 @@
 #include "common.h"
 #include "value.h"
 
+#include <assert.h>
+
 #define OBJ_TYPE(value) AS_OBJ(value)->type
 // This calls func b/c value might be a func with side effects (ex: Pop()), and value is being used more than once. We don't want to Pop twice.
 #define IS_STRING(value) IsObjType(value, OBJ_STRING)
@@ -14,22 +16,49 @@
 #define IS_FUNCTION(value) IsObjType(value, OBJ_FUNCTION)
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 
+#define IS_ROPE(value) IsObjType(value, OBJ_ROPE)
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
+
 #define IS_NATIVE(value) IsObjType(value, OBJ_NATIVE)
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
 
-typedef Value(*NativeFn) (int argCount, Value* args);
+typedef Value(*NativeFn) (VM* vm, int argCount, Value* args);
 
 typedef enum {
 	OBJ_NATIVE,
 	OBJ_FUNCTION,
 	OBJ_STRING,
+	OBJ_ROPE,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_ROPE + 1)
+
+// Use ObjNext() and SetObjNext() for the link to the next object in its list.
+#ifdef PACKED_OBJ_HEADER
+// The whole header is one 64 bit word. User space pointers fit in 48 bits on x86-64 and ARM64, so the link only 
+// takes those and the type and GC flags get the rest. All fields have the same type, otherwise MSVC doesn't pack 
+// them together. Every new object's address is checked, a heap handing out tagged pointers or addresses from a 
+// 57 bit address space stops the process instead of corrupting the object lists.
+#define OBJ_LINK_BITS 48
+
 struct Obj
 {
-	ObjType type;
-	struct Obj* next;
+	uint64_t link : OBJ_LINK_BITS;
+	uint64_t type : 8; // ObjType
+	uint64_t isMarked : 1;
+	uint64_t isOld : 1; // survived a collection
+	uint64_t isRemembered : 1; // old and in vm->remembered
 };
+#else
+struct Obj
+{
+	struct Obj* link;
+	uint8_t type; // ObjType
+	bool isMarked;
+	bool isOld; // survived a collection
+	bool isRemembered; // old and in vm->remembered
+};
+#endif
 
 typedef struct
 {
@@ -49,24 +78,88 @@ struct ObjString
 {
 	Obj obj;
 	int length;
-	char* chars;
-	uint32_t hash;
+	uint32_t hash; // only set if interned
+	// Strings from the source and natives are interned as they are made. Strings made at runtime never are, 
+	// so a concatenation that is just printed is never hashed. '==' compares their characters instead.
+	bool interned;
+	char chars[]; // null terminated, stored in the same allocation as the header
 };
 
+#define STRING_SIZE(length) (offsetof(ObjString, chars) + (length) + 1)
+
+// Concatenations shorter than this are copied right away, longer ones become ropes.
+#define ROPE_MIN_LENGTH 64
+
+// The result of concatenating two long strings, without the characters copied. 'left' and 'right' are each an 
+// ObjString or another ObjRope. FlattenRope() gathers the characters into an ObjString the first time the string is 
+// compared or printed, so building a string piece by piece is linear instead of quadratic.
+typedef struct
+{
+	Obj obj;
+	int length;
+	Obj* left;
+	Obj* right;
+	ObjString* flat; // NULL until flattened, after which 'left' and 'right' are dropped
+} ObjRope;
+
+#ifdef PACKED_OBJ_HEADER
+static inline Obj* ObjNext(Obj* object)
+{
+	return (Obj*)(uintptr_t)object->link;
+}
+
+// Only ever given objects that passed the check when they were allocated.
+static inline void SetObjNext(Obj* object, Obj* next)
+{
+	assert(((uint64_t)(uintptr_t)next >> OBJ_LINK_BITS) == 0);
+	object->link = (uintptr_t)next;
+}
+#else
+static inline Obj* ObjNext(Obj* object)
+{
+	return object->link;
+}
+
+static inline void SetObjNext(Obj* object, Obj* next)
+{
+	object->link = next;
+}
+#endif
+
 // not a macro b/c value is accessed twice and it might have side effects.
 static inline bool IsObjType(Value value, ObjType type)
 {
 	return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
-void PrintObject(Value value);
+// True for both flat strings and ropes.
+static inline bool IsStringValue(Value value)
+{
+	return IS_OBJ(value) && (AS_OBJ(value)->type == OBJ_STRING || AS_OBJ(value)->type == OBJ_ROPE);
+}
+
+static inline int StringLength(Obj* string)
+{
+	return string->type == OBJ_STRING ? ((ObjString*)string)->length : ((ObjRope*)string)->length;
+}
+
+void PrintObject(VM* vm, Value value);
 
-ObjFunction* NewFunction();
-ObjNative* NewNative(NativeFn function);
+ObjFunction* NewFunction(VM* vm);
+ObjNative* NewNative(VM* vm, NativeFn function);
 
-Obj* AllocateObject(size_t size, ObjType type);
+Obj* AllocateObject(VM* vm, size_t size, ObjType type);
+// The seed is shared by every VM so hashes stay comparable between them. Whichever InitVM() runs first picks it, 
+// on any thread, and every VM set up afterwards gets the same one.
+void SeedStringHash();
 uint32_t HashString(const char* key, int length);
-ObjString* CopyString(const char* str, int length);
-ObjString* TakeString(char* str, int length);
+ObjString* CopyString(VM* vm, const char* str, int length);
+// Allocates room for a string of 'length' characters. The result isn't an object until it is passed to 
+// TakeString(), fill in its chars first.
+ObjString* AllocateStringBuffer(VM* vm, int length);
+// Turns a filled in buffer into a string object. It is neither hashed nor interned.
+ObjString* TakeString(VM* vm, ObjString* buffer);
+ObjRope* NewRope(VM* vm, Obj* left, Obj* right);
+ObjString* FlattenRope(VM* vm, ObjRope* rope);
 
 #endif
\ No newline at end of file
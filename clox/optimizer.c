@@ -0,0 +1,442 @@
+#include "optimizer.h"
+
+#include "chunk.h"
+#include "memory.h"
+
+#include <string.h>
+
+/*
+	Type inference works on the stack of the function being specialized. Since locals are just stack slots, 
+	tracking the static type of every stack slot covers both locals and temporaries. Locals can only be 
+	written by the function that owns them so nothing outside of its bytecode can change their types.
+
+	The bytecode is split into blocks at jump destinations. Each block's entry state is the merge of the states
+	of all jumps/fallthroughs into it, and blocks are re-analyzed until no entry state changes. Types only ever
+	go from STATIC_NUMBER to STATIC_UNKNOWN so this always terminates.
+*/
+
+typedef enum
+{
+	STATIC_UNKNOWN,
+	STATIC_NUMBER,
+} StaticType;
+
+typedef struct
+{
+	bool reached;
+	bool queued;
+	int height;
+	uint8_t* types;
+} BlockState;
+
+typedef struct
+{
+	Chunk* chunk;
+	BlockState* blocks; // indexed by instruction offset, only used for block starts
+	bool* isBlockStart;
+	bool* isNumeric; // instruction at offset can use its *_NUMBER version
+	int* worklist;
+	int worklistCount;
+	bool failed; // bytecode we can't analyze. Leave the function alone.
+
+	uint8_t* stack;
+	int stackCapacity;
+	int stackCount;
+} Specializer;
+
+static int ReadLongIndex(Chunk* chunk, int offset)
+{
+	return chunk->code[offset] | (chunk->code[offset + 1] << 8) | (chunk->code[offset + 2] << 16);
+}
+
+// Returns the size in bytes of the instruction at 'offset' or -1 for instructions the pass doesn't know about.
+static int InstructionLength(Chunk* chunk, int offset)
+{
+	switch (chunk->code[offset])
+	{
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_NOT:
+	case OP_NEGATE:
+	case OP_EQUAL_SWITCH:
+	case OP_EQUAL:
+	case OP_NOT_EQUAL:
+	case OP_GREATER:
+	case OP_GREATER_EQUAL:
+	case OP_LESS:
+	case OP_LESS_EQUAL:
+	case OP_ADD:
+	case OP_SUB:
+	case OP_MULT:
+	case OP_DIV:
+	case OP_PRINT:
+	case OP_POP:
+	case OP_RETURN:
+		return 1;
+	case OP_CONSTANT:
+	case OP_ADD_N:
+	case OP_POPN:
+	case OP_DEFINE_GLOBAL:
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_ADD_LOCAL:
+	case OP_SUB_LOCAL:
+	case OP_MULT_LOCAL:
+	case OP_DIV_LOCAL:
+	case OP_ADD_GLOBAL:
+	case OP_SUB_GLOBAL:
+	case OP_MULT_GLOBAL:
+	case OP_DIV_GLOBAL:
+	case OP_CALL:
+		return 2;
+	case OP_INCREMENT_LOCAL:
+	case OP_INCREMENT_GLOBAL:
+		return 3;
+	case OP_CONSTANT_LONG:
+	case OP_DEFINE_GLOBAL_LONG:
+	case OP_GET_GLOBAL_LONG:
+	case OP_SET_GLOBAL_LONG:
+	case OP_GET_LOCAL_LONG:
+	case OP_SET_LOCAL_LONG:
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_JUMP_IF_TRUE:
+	case OP_JUMP_BACK:
+	case OP_JUMP_BACK_IF_TRUE:
+		return 4;
+	default:
+		return -1;
+	}
+}
+
+// Returns the destination of the jump instruction at 'offset'.
+static int JumpDestination(Chunk* chunk, int offset)
+{
+	int jumpOffset = ReadLongIndex(chunk, offset + 1);
+	switch (chunk->code[offset])
+	{
+	case OP_JUMP_BACK:
+	case OP_JUMP_BACK_IF_TRUE:
+		return offset + 4 - jumpOffset;
+	default:
+		return offset + 4 + jumpOffset;
+	}
+}
+
+static bool IsJump(uint8_t instruction)
+{
+	return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_JUMP_IF_TRUE ||
+		instruction == OP_JUMP_BACK || instruction == OP_JUMP_BACK_IF_TRUE;
+}
+
+static void Push(Specializer* specializer, uint8_t type)
+{
+	if (specializer->stackCount >= specializer->stackCapacity)
+	{
+		int oldCapacity = specializer->stackCapacity;
+		specializer->stackCapacity = GROW_CAPACITY(oldCapacity);
+		specializer->stack = ARENA_GROW_ARRAY(specializer->chunk->arena, uint8_t, specializer->stack, oldCapacity, 
+			specializer->stackCapacity);
+	}
+	specializer->stack[specializer->stackCount++] = type;
+}
+
+static uint8_t* Peek(Specializer* specializer, int distance)
+{
+	return &specializer->stack[specializer->stackCount - 1 - distance];
+}
+
+static void Pop(Specializer* specializer, int count)
+{
+	specializer->stackCount -= count;
+}
+
+// Merges the current stack into the entry state of the block starting at 'offset'.
+static void MergeInto(Specializer* specializer, int offset)
+{
+	BlockState* block = &specializer->blocks[offset];
+	bool changed = false;
+
+	if (!block->reached)
+	{
+		block->reached = true;
+		block->height = specializer->stackCount;
+		block->types = ARENA_ALLOCATE(specializer->chunk->arena, uint8_t, block->height > 0 ? block->height : 1);
+		memcpy(block->types, specializer->stack, block->height);
+		changed = true;
+	}
+	else if (block->height != specializer->stackCount)
+	{
+		specializer->failed = true;
+		return;
+	}
+	else
+	{
+		for (int i = 0; i < block->height; i++)
+		{
+			if (block->types[i] != specializer->stack[i] && block->types[i] != STATIC_UNKNOWN)
+			{
+				block->types[i] = STATIC_UNKNOWN;
+				changed = true;
+			}
+		}
+	}
+
+	if (changed && !block->queued)
+	{
+		block->queued = true;
+		specializer->worklist[specializer->worklistCount++] = offset;
+	}
+}
+
+static uint8_t ConstantType(Value value)
+{
+	return IS_NUMBER(value) ? STATIC_NUMBER : STATIC_UNKNOWN;
+}
+
+// Walks the block starting at 'start' until it ends or falls through into another block.
+static void AnalyzeBlock(Specializer* specializer, int start)
+{
+	Chunk* chunk = specializer->chunk;
+	BlockState* block = &specializer->blocks[start];
+	block->queued = false;
+
+	specializer->stackCount = 0;
+	for (int i = 0; i < block->height; i++) Push(specializer, block->types[i]);
+
+	int offset = start;
+	while (offset < chunk->count && !specializer->failed)
+	{
+		if (offset != start && specializer->isBlockStart[offset])
+		{
+			MergeInto(specializer, offset);
+			return;
+		}
+
+		uint8_t instruction = chunk->code[offset];
+		bool bothNumbers = specializer->stackCount >= 2 && 
+			*Peek(specializer, 0) == STATIC_NUMBER && *Peek(specializer, 1) == STATIC_NUMBER;
+		specializer->isNumeric[offset] = false;
+
+		switch (instruction)
+		{
+		case OP_CONSTANT: Push(specializer, ConstantType(chunk->constants.values[chunk->code[offset + 1]])); break;
+		case OP_CONSTANT_LONG: Push(specializer, ConstantType(chunk->constants.values[ReadLongIndex(chunk, offset + 1)])); break;
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_GET_GLOBAL:
+		case OP_GET_GLOBAL_LONG:
+			Push(specializer, STATIC_UNKNOWN);
+			break;
+		case OP_NOT:
+		case OP_EQUAL_SWITCH:
+			*Peek(specializer, 0) = STATIC_UNKNOWN;
+			break;
+		case OP_NEGATE:
+			specializer->isNumeric[offset] = *Peek(specializer, 0) == STATIC_NUMBER;
+			*Peek(specializer, 0) = STATIC_NUMBER; // anything else is a runtime error
+			break;
+		case OP_EQUAL:
+		case OP_NOT_EQUAL:
+			Pop(specializer, 1);
+			*Peek(specializer, 0) = STATIC_UNKNOWN;
+			break;
+		case OP_GREATER:
+		case OP_GREATER_EQUAL:
+		case OP_LESS:
+		case OP_LESS_EQUAL:
+			specializer->isNumeric[offset] = bothNumbers;
+			Pop(specializer, 1);
+			*Peek(specializer, 0) = STATIC_UNKNOWN;
+			break;
+		case OP_ADD:
+			specializer->isNumeric[offset] = bothNumbers;
+			Pop(specializer, 1);
+			*Peek(specializer, 0) = bothNumbers ? STATIC_NUMBER : STATIC_UNKNOWN; // might be a string
+			break;
+		case OP_ADD_N:
+		{
+			int operands = chunk->code[offset + 1];
+			if (specializer->stackCount < operands)
+			{
+				specializer->failed = true;
+				return;
+			}
+			bool allNumbers = true;
+			for (int i = 0; i < operands && allNumbers; i++) allNumbers = *Peek(specializer, i) == STATIC_NUMBER;
+			specializer->isNumeric[offset] = allNumbers;
+			Pop(specializer, operands - 1);
+			*Peek(specializer, 0) = allNumbers ? STATIC_NUMBER : STATIC_UNKNOWN;
+			break;
+		}
+		case OP_SUB:
+		case OP_MULT:
+		case OP_DIV:
+			specializer->isNumeric[offset] = bothNumbers;
+			Pop(specializer, 1);
+			*Peek(specializer, 0) = STATIC_NUMBER;
+			break;
+		case OP_PRINT:
+		case OP_POP:
+		case OP_DEFINE_GLOBAL:
+		case OP_DEFINE_GLOBAL_LONG:
+			Pop(specializer, 1);
+			break;
+		case OP_POPN: Pop(specializer, chunk->code[offset + 1]); break;
+		case OP_SET_GLOBAL:
+		case OP_SET_GLOBAL_LONG:
+			break;
+		case OP_GET_LOCAL: Push(specializer, specializer->stack[chunk->code[offset + 1]]); break;
+		case OP_GET_LOCAL_LONG: Push(specializer, specializer->stack[ReadLongIndex(chunk, offset + 1)]); break;
+		case OP_SET_LOCAL: specializer->stack[chunk->code[offset + 1]] = *Peek(specializer, 0); break;
+		case OP_SET_LOCAL_LONG: specializer->stack[ReadLongIndex(chunk, offset + 1)] = *Peek(specializer, 0); break;
+		case OP_ADD_LOCAL:
+		case OP_SUB_LOCAL:
+		case OP_MULT_LOCAL:
+		case OP_DIV_LOCAL:
+		{
+			uint8_t* local = &specializer->stack[chunk->code[offset + 1]];
+			bool numeric = *local == STATIC_NUMBER && *Peek(specializer, 0) == STATIC_NUMBER;
+			specializer->isNumeric[offset] = numeric;
+			*local = *Peek(specializer, 0) = (numeric || instruction != OP_ADD_LOCAL) ? STATIC_NUMBER : STATIC_UNKNOWN;
+			break;
+		}
+		case OP_INCREMENT_LOCAL:
+		{
+			uint8_t* local = &specializer->stack[chunk->code[offset + 1]];
+			specializer->isNumeric[offset] = *local == STATIC_NUMBER;
+			*local = STATIC_NUMBER;
+			Push(specializer, STATIC_NUMBER);
+			break;
+		}
+		case OP_ADD_GLOBAL: *Peek(specializer, 0) = STATIC_UNKNOWN; break;
+		case OP_SUB_GLOBAL:
+		case OP_MULT_GLOBAL:
+		case OP_DIV_GLOBAL:
+			*Peek(specializer, 0) = STATIC_NUMBER;
+			break;
+		case OP_INCREMENT_GLOBAL: Push(specializer, STATIC_NUMBER); break;
+		case OP_JUMP:
+		case OP_JUMP_BACK:
+			MergeInto(specializer, JumpDestination(chunk, offset));
+			return;
+		case OP_JUMP_IF_FALSE:
+		case OP_JUMP_IF_TRUE:
+			MergeInto(specializer, JumpDestination(chunk, offset));
+			break;
+		case OP_JUMP_BACK_IF_TRUE:
+			Pop(specializer, 1);
+			MergeInto(specializer, JumpDestination(chunk, offset));
+			break;
+		case OP_CALL:
+			Pop(specializer, chunk->code[offset + 1] + 1);
+			Push(specializer, STATIC_UNKNOWN);
+			break;
+		case OP_RETURN:
+			return;
+		default:
+			specializer->failed = true;
+			return;
+		}
+
+		if (specializer->stackCount < 0)
+		{
+			specializer->failed = true;
+			return;
+		}
+		offset += InstructionLength(chunk, offset);
+	}
+}
+
+static uint8_t NumberVersion(uint8_t instruction)
+{
+	switch (instruction)
+	{
+	case OP_NEGATE: return OP_NEGATE_NUMBER;
+	case OP_GREATER: return OP_GREATER_NUMBER;
+	case OP_GREATER_EQUAL: return OP_GREATER_EQUAL_NUMBER;
+	case OP_LESS: return OP_LESS_NUMBER;
+	case OP_LESS_EQUAL: return OP_LESS_EQUAL_NUMBER;
+	case OP_ADD: return OP_ADD_NUMBER;
+	case OP_SUB: return OP_SUB_NUMBER;
+	case OP_MULT: return OP_MULT_NUMBER;
+	case OP_DIV: return OP_DIV_NUMBER;
+	case OP_ADD_N: return OP_ADD_N_NUMBER;
+	case OP_ADD_LOCAL: return OP_ADD_LOCAL_NUMBER;
+	case OP_SUB_LOCAL: return OP_SUB_LOCAL_NUMBER;
+	case OP_MULT_LOCAL: return OP_MULT_LOCAL_NUMBER;
+	case OP_DIV_LOCAL: return OP_DIV_LOCAL_NUMBER;
+	case OP_INCREMENT_LOCAL: return OP_INCREMENT_LOCAL_NUMBER;
+	default:
+		return instruction; // unreachable
+	}
+}
+
+void SpecializeNumberOps(ObjFunction* function)
+{
+	Chunk* chunk = &function->chunk;
+	if (chunk->count == 0) return;
+
+	Specializer specializer;
+	specializer.chunk = chunk;
+	// Scratch arrays come from the compiler's arena, like the chunk itself.
+	Arena* arena = chunk->arena;
+	specializer.blocks = ARENA_ALLOCATE(arena, BlockState, chunk->count);
+	specializer.isBlockStart = ARENA_ALLOCATE(arena, bool, chunk->count);
+	specializer.isNumeric = ARENA_ALLOCATE(arena, bool, chunk->count);
+	specializer.worklist = ARENA_ALLOCATE(arena, int, chunk->count);
+	specializer.worklistCount = 0;
+	specializer.failed = false;
+	specializer.stack = NULL;
+	specializer.stackCapacity = specializer.stackCount = 0;
+
+	memset(specializer.blocks, 0, sizeof(BlockState) * chunk->count);
+	memset(specializer.isBlockStart, 0, sizeof(bool) * chunk->count);
+	memset(specializer.isNumeric, 0, sizeof(bool) * chunk->count);
+
+	specializer.isBlockStart[0] = true;
+	for (int offset = 0; offset < chunk->count;)
+	{
+		int length = InstructionLength(chunk, offset);
+		if (length == -1) 
+		{
+			specializer.failed = true;
+			break;
+		}
+
+		if (IsJump(chunk->code[offset]))
+		{
+			int destination = JumpDestination(chunk, offset);
+			if (destination < 0 || destination >= chunk->count)
+			{
+				specializer.failed = true;
+				break;
+			}
+			specializer.isBlockStart[destination] = true;
+		}
+		offset += length;
+	}
+
+	// Slot zero holds the function being called, the parameters come after it. Callers can pass anything.
+	for (int i = 0; i <= function->arity; i++) Push(&specializer, STATIC_UNKNOWN);
+	if (!specializer.failed) MergeInto(&specializer, 0);
+
+	while (specializer.worklistCount > 0 && !specializer.failed)
+	{
+		AnalyzeBlock(&specializer, specializer.worklist[--specializer.worklistCount]);
+	}
+
+	if (!specializer.failed)
+	{
+		for (int offset = 0; offset < chunk->count;)
+		{
+			int length = InstructionLength(chunk, offset);
+			if (specializer.isNumeric[offset]) chunk->code[offset] = NumberVersion(chunk->code[offset]);
+			offset += length;
+		}
+	}
+}
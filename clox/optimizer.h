@@ -0,0 +1,11 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "object.h"
+
+// Infers which stack slots (locals and temporaries) always hold numbers and rewrites arithmetic and comparison
+// instructions operating only on those slots to unchecked *_NUMBER versions. Instructions whose operand types 
+// can't be proven stay generic.
+void SpecializeNumberOps(ObjFunction* function);
+
+#endif // !clox_optimizer_h
@@ -6,81 +6,223 @@
 #include <stdio.h>
 #include <string.h>
 
-typedef struct {
-	const char* start;
-	const char* current;
-	int line;
-} Scanner;
+#ifdef CLOX_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+void InitScanner(Scanner* scanner, const char* source)
+{
+	scanner->start = scanner->current = source;
+	scanner->end = source + strlen(source);
+	scanner->line = 1;
+	scanner->tokensHead = scanner->tokensCount = 0;
+}
+
+#ifdef CLOX_SSE2
+/*
+	The SSE2 helpers classify 16 bytes at a time and return a bitmask with one bit per byte. A block is only loaded 
+	while all of it is inside the source, null terminator included, the source can be any string the host hands 
+	us. The last partial block is scanned a byte at a time.
+*/
+
+static bool IsIdentifierPrefix(char c);
+static bool IsDigit(char c);
+
+#define BLOCK_FITS(p, end) ((end) - (p) >= 15)
 
-static Scanner scanner;
+static inline int CountTrailingZeros(unsigned int mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+static inline int PopCount(unsigned int mask)
+{
+#ifdef _MSC_VER
+	return (int)__popcnt(mask);
+#else
+	return __builtin_popcount(mask);
+#endif
+}
+
+static inline unsigned int ByteMask(__m128i block, char c)
+{
+	return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+// Bytes in [low, high]. Bytes >= 0x80 are negative as signed chars so they never match.
+static inline __m128i InRange(__m128i block, char low, char high)
+{
+	return _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8(low - 1)), _mm_cmplt_epi8(block, _mm_set1_epi8(high + 1)));
+}
+
+static inline unsigned int IdentifierMask(__m128i block)
+{
+	__m128i letters = _mm_or_si128(InRange(block, 'a', 'z'), InRange(block, 'A', 'Z'));
+	__m128i rest = _mm_or_si128(InRange(block, '0', '9'), _mm_cmpeq_epi8(block, _mm_set1_epi8('_')));
+	return (unsigned int)_mm_movemask_epi8(_mm_or_si128(letters, rest));
+}
+
+static inline unsigned int DigitMask(__m128i block)
+{
+	return (unsigned int)_mm_movemask_epi8(InRange(block, '0', '9'));
+}
+
+static inline __m128i LoadBlock(const char* p)
+{
+	return _mm_loadu_si128((const __m128i*)p);
+}
+
+// Returns the first character at or after p that isn't part of an identifier. 'end' points at the null terminator.
+static const char* FindIdentifierEnd(const char* p, const char* end)
+{
+	for (; BLOCK_FITS(p, end); p += 16)
+	{
+		unsigned int stop = ~IdentifierMask(LoadBlock(p)) & 0xFFFF;
+		if (stop != 0) return p + CountTrailingZeros(stop);
+	}
+	while (IsIdentifierPrefix(*p) || IsDigit(*p)) p++;
+	return p;
+}
+
+static const char* FindDigitsEnd(const char* p, const char* end)
+{
+	for (; BLOCK_FITS(p, end); p += 16)
+	{
+		unsigned int stop = ~DigitMask(LoadBlock(p)) & 0xFFFF;
+		if (stop != 0) return p + CountTrailingZeros(stop);
+	}
+	while (IsDigit(*p)) p++;
+	return p;
+}
+
+// Returns the first occurence of 'c' or the null terminator at or after p. Adds newlines skipped over to 'line'.
+static const char* FindCharOrEnd(const char* p, const char* end, char c, int* line)
+{
+	for (; BLOCK_FITS(p, end); p += 16)
+	{
+		__m128i bytes = LoadBlock(p);
+		unsigned int stop = ByteMask(bytes, c) | ByteMask(bytes, '\0');
+		unsigned int newlines = ByteMask(bytes, '\n');
+		if (stop != 0)
+		{
+			int index = CountTrailingZeros(stop);
+			*line += PopCount(newlines & ((1u << index) - 1));
+			return p + index;
+		}
+		*line += PopCount(newlines);
+	}
+	for (; *p != c && *p != '\0'; p++)
+	{
+		if (*p == '\n') (*line)++;
+	}
+	return p;
+}
 
-void InitScanner(const char* source)
+// Returns the first character at or after p that isn't a space, tab, carriage return or newline.
+static const char* FindBlanksEnd(const char* p, const char* end, int* line)
 {
-	scanner.start = scanner.current = source;
-	scanner.line = 1;
+	for (; BLOCK_FITS(p, end); p += 16)
+	{
+		__m128i bytes = LoadBlock(p);
+		unsigned int newlines = ByteMask(bytes, '\n');
+		unsigned int blanks = ByteMask(bytes, ' ') | ByteMask(bytes, '\t') | ByteMask(bytes, '\r') | newlines;
+		unsigned int stop = ~blanks & 0xFFFF;
+		if (stop != 0)
+		{
+			int index = CountTrailingZeros(stop);
+			*line += PopCount(newlines & ((1u << index) - 1));
+			return p + index;
+		}
+		*line += PopCount(newlines);
+	}
+	for (; *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'; p++)
+	{
+		if (*p == '\n') (*line)++;
+	}
+	return p;
 }
+#endif
 
-static bool IsAtEnd()
+static bool IsAtEnd(Scanner* scanner)
 {
-	return *scanner.current == '\0';
+	return *scanner->current == '\0';
 }
 
-static Token MakeToken(TokenType type)
+static Token MakeToken(Scanner* scanner, TokenType type)
 {
 	Token token;
 	token.type = type;
-	token.start = scanner.start;
-	token.length = (int)(scanner.current - scanner.start);
-	token.line = scanner.line;
+	token.start = scanner->start;
+	token.length = (int)(scanner->current - scanner->start);
+	token.line = scanner->line;
 	return token;
 }
 
-static Token ErrorToken(const char* message)
+static Token ErrorToken(Scanner* scanner, const char* message)
 {
 	Token token;
 	token.type = TOKEN_ERROR;
 	token.start = message;
 	token.length = (int)strlen(message);
-	token.line = scanner.line;
+	token.line = scanner->line;
 	return token;
 }
 
-static char Advance()
+static char Advance(Scanner* scanner)
 {
-	scanner.current++;
-	return scanner.current[-1];
+	scanner->current++;
+	return scanner->current[-1];
 }
 
-static bool Match(char c)
+static bool Match(Scanner* scanner, char c)
 {
-	if (*scanner.current == c)
+	if (*scanner->current == c)
 	{
-		scanner.current++;
+		scanner->current++;
 		return true;
 	}
 	return false;
 }
 
-static void SkipWhitespace()
+static void SkipWhitespace(Scanner* scanner)
 {
 	while (true)
 	{
-		switch (*scanner.current)
+		switch (*scanner->current)
 		{
 		case ' ':
 		case '\r':
 		case '\t':
-			scanner.current++;
+			scanner->current++;
 			break;
 		case '\n':
-			scanner.line++;
-			scanner.current++;
+#ifdef CLOX_SSE2
+			// Runs of indentation/blank lines are skipped in 16 byte blocks.
+			scanner->current = FindBlanksEnd(scanner->current, scanner->end, &scanner->line);
+#else
+			scanner->line++;
+			scanner->current++;
+#endif
 			break;
 		case '/':
-			if (scanner.current[1] == '/')
+			if (scanner->current[1] == '/')
 			{
-				scanner.current += 2;
-				while (*scanner.current != '\n' && !IsAtEnd()) { scanner.current++; }
+				scanner->current += 2;
+#ifdef CLOX_SSE2
+				int line = 0; // the newline ending the comment is handled above
+				scanner->current = FindCharOrEnd(scanner->current, scanner->end, '\n', &line);
+#else
+				while (*scanner->current != '\n' && !IsAtEnd(scanner)) { scanner->current++; }
+#endif
 				break;
 			}
 			else
@@ -93,25 +235,29 @@ static void SkipWhitespace()
 	}
 }
 
-static Token String()
+static Token String(Scanner* scanner)
 {
-	while (*scanner.current != '"' && !IsAtEnd())
+#ifdef CLOX_SSE2
+	scanner->current = FindCharOrEnd(scanner->current, scanner->end, '"', &scanner->line);
+#else
+	while (*scanner->current != '"' && !IsAtEnd(scanner))
 	{
-		if (*scanner.current == '\n') { scanner.line++; }
-		scanner.current++;
+		if (*scanner->current == '\n') { scanner->line++; }
+		scanner->current++;
 	}
+#endif
 
-	if (!Match('"'))
+	if (!Match(scanner, '"'))
 	{
-		return ErrorToken("Expect '\"' at end of string literal.");
+		return ErrorToken(scanner, "Expect '\"' at end of string literal.");
 	}
 	
 	// exclude opening and closing double quotes from token
-	scanner.start++; 
-	scanner.current--; 
+	scanner->start++; 
+	scanner->current--; 
 
-	Token stringLiteral = MakeToken(TOKEN_STRING);
-	scanner.current++;
+	Token stringLiteral = MakeToken(scanner, TOKEN_STRING);
+	scanner->current++;
 
 	return stringLiteral;
 }
@@ -121,27 +267,33 @@ static bool IsDigit(char c)
 	return c >= '0' && c <= '9';
 }
 
-static Token Number()
+static void SkipDigits(Scanner* scanner)
 {
-	while (IsDigit(*scanner.current))
+#ifdef CLOX_SSE2
+	scanner->current = FindDigitsEnd(scanner->current, scanner->end);
+#else
+	while (IsDigit(*scanner->current))
 	{
-		scanner.current++;
+		scanner->current++;
 	}
+#endif
+}
 
-	if (Match('.'))
+static Token Number(Scanner* scanner)
+{
+	SkipDigits(scanner);
+
+	if (Match(scanner, '.'))
 	{
-		if (!IsDigit(*scanner.current))
+		if (!IsDigit(*scanner->current))
 		{
-			return ErrorToken("Missing fraction.");
+			return ErrorToken(scanner, "Missing fraction.");
 		}
 
-		while (IsDigit(*scanner.current))
-		{
-			scanner.current++;
-		}
+		SkipDigits(scanner);
 	}
 
-	return MakeToken(TOKEN_NUMBER);
+	return MakeToken(scanner, TOKEN_NUMBER);
 }
 
 static bool IsIdentifierPrefix(char c)
@@ -151,10 +303,10 @@ static bool IsIdentifierPrefix(char c)
 		(c >= 'A' && c <= 'Z');
 }
 
-static TokenType CheckKeyword(int startOffset, int length, const char* rest, TokenType type)
+static TokenType CheckKeyword(Scanner* scanner, int startOffset, int length, const char* rest, TokenType type)
 {
-	if (scanner.current - scanner.start == startOffset + length &&
-		memcmp(rest, scanner.start + startOffset, length) == 0)
+	if (scanner->current - scanner->start == startOffset + length &&
+		memcmp(rest, scanner->start + startOffset, length) == 0)
 	{
 		return type;
 	}
@@ -162,62 +314,67 @@ static TokenType CheckKeyword(int startOffset, int length, const char* rest, Tok
 	return TOKEN_IDENTIFIER;
 }
 
-static TokenType IdentifierOrKeywordType()
+static TokenType IdentifierOrKeywordType(Scanner* scanner)
 {
-	switch (*scanner.start)
+	switch (*scanner->start)
 	{
-	case 'a': return CheckKeyword(1, 2, "nd", TOKEN_AND);
+	case 'a': return CheckKeyword(scanner, 1, 2, "nd", TOKEN_AND);
 	case 'c': 
-		if (scanner.current - scanner.start > 1)
+		if (scanner->current - scanner->start > 1)
 		{
-			switch (scanner.start[1])
+			switch (scanner->start[1])
 			{
-			case 'a': return CheckKeyword(2, 2, "se", TOKEN_CASE);
-			case 'l': return CheckKeyword(2, 3, "ass", TOKEN_CLASS);
-			case 'o': return CheckKeyword(2, 6, "ntinue", TOKEN_CONTINUE);
+			case 'a': return CheckKeyword(scanner, 2, 2, "se", TOKEN_CASE);
+			case 'l': return CheckKeyword(scanner, 2, 3, "ass", TOKEN_CLASS);
+			case 'o': 
+				if (scanner->current - scanner->start > 3 && scanner->start[3] == 's')
+				{
+					return CheckKeyword(scanner, 2, 3, "nst", TOKEN_CONST);
+				}
+				return CheckKeyword(scanner, 2, 6, "ntinue", TOKEN_CONTINUE);
 			}
 		}
 		break;
-	case 'd': return CheckKeyword(1, 6, "efault", TOKEN_DEFAULT);
-	case 'e': return CheckKeyword(1, 3, "lse", TOKEN_ELSE);
+	case 'd': return CheckKeyword(scanner, 1, 6, "efault", TOKEN_DEFAULT);
+	case 'e': return CheckKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
 	case 'f':
-		if (scanner.current - scanner.start > 1)
+		if (scanner->current - scanner->start > 1)
 		{
-			switch (scanner.start[1])
+			switch (scanner->start[1])
 			{
-			case 'a': return CheckKeyword(2, 3, "lse", TOKEN_FALSE);
-			case 'o': return CheckKeyword(2, 1, "r", TOKEN_FOR);
-			case 'u': return CheckKeyword(2, 1, "n", TOKEN_FUN);
+			case 'a': return CheckKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+			case 'o': return CheckKeyword(scanner, 2, 1, "r", TOKEN_FOR);
+			case 'u': return CheckKeyword(scanner, 2, 1, "n", TOKEN_FUN);
 			}
 		}
 		break;
-	case 'i': return CheckKeyword(1, 1, "f", TOKEN_IF);
-	case 'n': return CheckKeyword(1, 2, "il", TOKEN_NIL);
-	case 'o': return CheckKeyword(1, 1, "r", TOKEN_OR);
-	case 'p': return CheckKeyword(1, 4, "rint", TOKEN_PRINT);
-	case 'r': return CheckKeyword(1, 5, "eturn", TOKEN_RETURN);
+	case 'i': return CheckKeyword(scanner, 1, 1, "f", TOKEN_IF);
+	case 'n': return CheckKeyword(scanner, 1, 2, "il", TOKEN_NIL);
+	case 'o': return CheckKeyword(scanner, 1, 1, "r", TOKEN_OR);
+	case 'p': return CheckKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
+	case 'r': return CheckKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
 	case 's': 
-		if (scanner.current - scanner.start > 1)
+		if (scanner->current - scanner->start > 1)
 		{
-			switch (scanner.start[1])
+			switch (scanner->start[1])
 			{
-			case 'u': return CheckKeyword(2, 3, "per", TOKEN_SUPER);
-			case 'w': return CheckKeyword(2, 4, "itch", TOKEN_SWITCH);
+			case 'u': return CheckKeyword(scanner, 2, 3, "per", TOKEN_SUPER);
+			case 'w': return CheckKeyword(scanner, 2, 4, "itch", TOKEN_SWITCH);
 			}
 		}
 		break;
 	case 't':
-		if (scanner.current - scanner.start > 1)
+		if (scanner->current - scanner->start > 1)
 		{
-			switch (scanner.start[1])
+			switch (scanner->start[1])
 			{
-			case 'h': return CheckKeyword(2, 2, "is", TOKEN_THIS);
-			case 'r': return CheckKeyword(2, 2, "ue", TOKEN_TRUE);
+			case 'h': return CheckKeyword(scanner, 2, 2, "is", TOKEN_THIS);
+			case 'r': return CheckKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
 			}
 		}
 		break;
-	case 'v': return CheckKeyword(1, 2, "ar", TOKEN_VAR);
-	case 'w': return CheckKeyword(1, 4, "hile", TOKEN_WHILE);
+	case 'v': return CheckKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
+	case 'w': return CheckKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
 	default:
 		break;
 	}
@@ -225,51 +382,97 @@ static TokenType IdentifierOrKeywordType()
 	return TOKEN_IDENTIFIER;
 }
 
-static Token IdentifierOrKeyword()
+static Token IdentifierOrKeyword(Scanner* scanner)
 {
-	while (IsIdentifierPrefix(*scanner.current) || IsDigit(*scanner.current))
+#ifdef CLOX_SSE2
+	scanner->current = FindIdentifierEnd(scanner->current, scanner->end);
+#else
+	while (IsIdentifierPrefix(*scanner->current) || IsDigit(*scanner->current))
 	{
-		scanner.current++;
+		scanner->current++;
 	}
+#endif
 
-	return MakeToken(IdentifierOrKeywordType());
+	return MakeToken(scanner, IdentifierOrKeywordType(scanner));
 }
 
-Token ScanToken()
+static Token ScanNextToken(Scanner* scanner)
 {
-	SkipWhitespace();
+	SkipWhitespace(scanner);
 
-	scanner.start = scanner.current;
+	scanner->start = scanner->current;
 
-	if (IsAtEnd()) { return MakeToken(TOKEN_EOF); }
+	if (IsAtEnd(scanner)) { return MakeToken(scanner, TOKEN_EOF); }
 
-	char c = Advance();
+	char c = Advance(scanner);
 
-	if (IsDigit(c)) { return Number(); }
-	if (IsIdentifierPrefix(c)) { return IdentifierOrKeyword(); }
+	if (IsDigit(c)) { return Number(scanner); }
+	if (IsIdentifierPrefix(c)) { return IdentifierOrKeyword(scanner); }
 
 	switch (c)
 	{
-	case '(': return MakeToken(TOKEN_LEFT_PAREN);
-	case ')': return MakeToken(TOKEN_RIGHT_PAREN);
-	case '{': return MakeToken(TOKEN_LEFT_BRACE);
-	case '}': return MakeToken(TOKEN_RIGHT_BRACE);
-	case ';': return MakeToken(TOKEN_SEMICOLON);
-	case ':': return MakeToken(TOKEN_COLON);
-	case ',': return MakeToken(TOKEN_COMMA);
-	case '.': return MakeToken(TOKEN_DOT);
-	case '-': return MakeToken(TOKEN_MINUS);
-	case '+': return MakeToken(TOKEN_PLUS);
-	case '/': return MakeToken(TOKEN_SLASH);
-	case '*': return MakeToken(TOKEN_STAR);
-	case '!': return MakeToken(Match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
-	case '=': return MakeToken(Match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-	case '<': return MakeToken(Match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
-	case '>': return MakeToken(Match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
-	case '"': return String();
+	case '(': return MakeToken(scanner, TOKEN_LEFT_PAREN);
+	case ')': return MakeToken(scanner, TOKEN_RIGHT_PAREN);
+	case '{': return MakeToken(scanner, TOKEN_LEFT_BRACE);
+	case '}': return MakeToken(scanner, TOKEN_RIGHT_BRACE);
+	case ';': return MakeToken(scanner, TOKEN_SEMICOLON);
+	case ':': return MakeToken(scanner, TOKEN_COLON);
+	case ',': return MakeToken(scanner, TOKEN_COMMA);
+	case '.': return MakeToken(scanner, TOKEN_DOT);
+	case '-': 
+		if (Match(scanner, '-')) return MakeToken(scanner, TOKEN_MINUS_MINUS);
+		return MakeToken(scanner, Match(scanner, '=') ? TOKEN_MINUS_EQUAL : TOKEN_MINUS);
+	case '+': 
+		if (Match(scanner, '+')) return MakeToken(scanner, TOKEN_PLUS_PLUS);
+		return MakeToken(scanner, Match(scanner, '=') ? TOKEN_PLUS_EQUAL : TOKEN_PLUS);
+	case '/': return MakeToken(scanner, Match(scanner, '=') ? TOKEN_SLASH_EQUAL : TOKEN_SLASH);
+	case '*': return MakeToken(scanner, Match(scanner, '=') ? TOKEN_STAR_EQUAL : TOKEN_STAR);
+	case '!': return MakeToken(scanner, Match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+	case '=': return MakeToken(scanner, Match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+	case '<': return MakeToken(scanner, Match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+	case '>': return MakeToken(scanner, Match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+	case '"': return String(scanner);
 	default: 
 		break;
 	}
 
-	return ErrorToken("Unexpected character.");
+	return ErrorToken(scanner, "Unexpected character.");
+}
+
+static void FillTokenBuffer(Scanner* scanner)
+{
+	scanner->tokensHead = scanner->tokensCount = 0;
+	while (scanner->tokensCount < TOKEN_BUFFER_SIZE)
+	{
+		Token token = ScanNextToken(scanner);
+		scanner->tokens[scanner->tokensCount++] = token;
+		if (token.type == TOKEN_EOF) { break; }
+	}
+}
+
+Token ScanToken(Scanner* scanner)
+{
+	if (scanner->tokensHead == scanner->tokensCount)
+	{
+		FillTokenBuffer(scanner);
+	}
+
+	return scanner->tokens[scanner->tokensHead++];
+}
+
+void RewindScanner(Scanner* scanner, Token* token)
+{
+	scanner->tokensHead = scanner->tokensCount = 0;
+	scanner->start = scanner->current = token->start;
+	scanner->line = token->line;
+
+	if (token->type == TOKEN_STRING)
+	{
+		// String tokens exclude the opening quote and carry the line the literal ends on.
+		for (int i = 0; i < token->length; i++)
+		{
+			if (token->start[i] == '\n') { scanner->line--; }
+		}
+		scanner->start = scanner->current = token->start - 1;
+	}
 }
@@ -13,12 +13,15 @@ typedef enum {
 	TOKEN_EQUAL, TOKEN_EQUAL_EQUAL,
 	TOKEN_GREATER, TOKEN_GREATER_EQUAL,
 	TOKEN_LESS, TOKEN_LESS_EQUAL,
+	TOKEN_PLUS_EQUAL, TOKEN_MINUS_EQUAL,
+	TOKEN_STAR_EQUAL, TOKEN_SLASH_EQUAL,
+	TOKEN_PLUS_PLUS, TOKEN_MINUS_MINUS,
 
 	// Literals.
 	TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
 
 	// Keywords.
-	TOKEN_AND, TOKEN_CASE, TOKEN_CLASS, TOKEN_CONTINUE, TOKEN_DEFAULT, TOKEN_ELSE, TOKEN_FALSE,
+	TOKEN_AND, TOKEN_CASE, TOKEN_CLASS, TOKEN_CONST, TOKEN_CONTINUE, TOKEN_DEFAULT, TOKEN_ELSE, TOKEN_FALSE,
 	TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
 	TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_SWITCH,
 	TOKEN_THIS, TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
@@ -35,7 +38,23 @@ typedef struct
 	int line;
 } Token;
 
-void InitScanner(const char* source);
-Token ScanToken();
+// Tokens are scanned in batches ahead of the parser.
+#define TOKEN_BUFFER_SIZE 64
+
+typedef struct {
+	const char* start;
+	const char* current;
+	const char* end; // the source's null terminator
+	int line;
+
+	Token tokens[TOKEN_BUFFER_SIZE];
+	int tokensHead; // next token to hand out
+	int tokensCount;
+} Scanner;
+
+void InitScanner(Scanner* scanner, const char* source);
+Token ScanToken(Scanner* scanner);
+// Restarts scanning at 'token', which must have been returned by ScanToken() for the current source.
+void RewindScanner(Scanner* scanner, Token* token);
 
 #endif // !clox_scanner_h
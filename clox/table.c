@@ -3,112 +3,211 @@
 #include "memory.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 #include <string.h>
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef CLOX_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Tables get resized once live entries + tombstones exceed 7/8 of capacity. This guarantees every probe 
+// sequence eventually hits a group with an empty slot.
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+// The low bits of the hash pick the group, the top 7 bits are stored in the control byte.
+#define HASH_FRAGMENT(hash) ((uint8_t)((hash) >> 25))
 
 void InitTable(Table* table)
 {
 	table->count = 0;
+	table->tombstones = 0;
 	table->capacity = 0;
+	table->control = NULL;
 	table->entries = NULL;
 }
 
-void FreeTable(Table* table)
+#define TABLE_BYTES(capacity) ((sizeof(uint8_t) + sizeof(Entry)) * (size_t)(capacity))
+
+void FreeTable(VM* vm, Table* table)
 {
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+	FREE_ARRAY(vm, uint8_t, table->control, table->capacity);
+	FREE_ARRAY(vm, Entry, table->entries, table->capacity);
+	vm->memStats.tableBytes -= TABLE_BYTES(table->capacity);
 	InitTable(table);
 }
 
-// Helper function that returns Entry e where e.key == key or e.key == NULL
-static Entry* FindEntry(Entry* entries, int capacity, ObjString* key)
+static inline int FirstBit(unsigned int mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// Returns a bitmask of the slots in the group starting at 'control' whose control byte is 'value'.
+static inline unsigned int MatchGroup(const uint8_t* control, uint8_t value)
+{
+#ifdef CLOX_SSE2
+	__m128i group = _mm_loadu_si128((const __m128i*)control);
+	return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)value)));
+#else
+	unsigned int mask = 0;
+	for (int i = 0; i < TABLE_GROUP_SIZE; i++)
+	{
+		if (control[i] == value) mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
+
+// Empty and deleted slots are the only control bytes with the high bit set.
+static inline unsigned int MatchEmptyOrDeleted(const uint8_t* control)
 {
-	uint32_t index = key->hash % capacity;
-	Entry* entry = &entries[index];
-	Entry* tombstone = NULL;
+#ifdef CLOX_SSE2
+	return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)control));
+#else
+	unsigned int mask = 0;
+	for (int i = 0; i < TABLE_GROUP_SIZE; i++)
+	{
+		if (control[i] & 0x80) mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
 
-	// This loop always terminates because of the load factor (0.75 above).
+static inline int FirstGroup(uint32_t hash, int capacity)
+{
+	return (int)(hash & (uint32_t)(capacity - 1) & ~(uint32_t)(TABLE_GROUP_SIZE - 1));
+}
+
+static inline int NextGroup(int group, int capacity)
+{
+	return (group + TABLE_GROUP_SIZE) & (capacity - 1);
+}
+
+// Returns the index of key's entry or -1.
+static int FindEntry(Table* table, ObjString* key)
+{
+	uint8_t fragment = HASH_FRAGMENT(key->hash);
+	int group = FirstGroup(key->hash, table->capacity);
+
+	// This loop always terminates because of the load factor (see TABLE_MAX_LOAD above).
 	while (true)
-	{		
-		if (entry->key == NULL)
+	{
+		const uint8_t* control = &table->control[group];
+		for (unsigned int match = MatchGroup(control, fragment); match != 0; match &= match - 1)
 		{
-			if (IS_NIL(entry->value))
-			{
-				// If we couldn't find entry e where e.key == key we return 
-				return tombstone != NULL ? tombstone : entry;
-			}
-			else
-			{
-				if (tombstone == NULL) tombstone = entry;
-			}
+			int index = group + FirstBit(match);
+			if (table->entries[index].key == key) return index;
 		}
-		else if (entry->key == key) return entry;
 
-		index = (index + 1) % capacity;
-		entry = &entries[index];
+		if (MatchGroup(control, TABLE_EMPTY) != 0) return -1;
+		group = NextGroup(group, table->capacity);
 	}
 }
 
-static void AdjustCapacity(Table* table, int capacity)
+// Returns the first empty or deleted slot on key's probe sequence. The key must not be in the table.
+static int FindInsertSlot(uint8_t* control, int capacity, uint32_t hash)
 {
-	Entry* adjusted = ALLOCATE(Entry, capacity);
-	
-	for (int i = 0; i < capacity; i++)
+	int group = FirstGroup(hash, capacity);
+	while (true)
 	{
-		adjusted[i].key = NULL;
-		adjusted[i].value = NIL_VAL;
+		unsigned int free = MatchEmptyOrDeleted(&control[group]);
+		if (free != 0) return group + FirstBit(free);
+		group = NextGroup(group, capacity);
 	}
+}
 
-	Entry* old = table->entries;
-	int oldCapacity = table->capacity;
-
-	table->entries = adjusted;
-	table->count = 0;
-	table->capacity = capacity;
+static void AdjustCapacity(VM* vm, Table* table, int capacity)
+{
+	uint8_t* control = ALLOCATE(vm, uint8_t, capacity);
+	Entry* entries = ALLOCATE(vm, Entry, capacity);
+	memset(control, TABLE_EMPTY, capacity);
+	for (int i = 0; i < capacity; i++)
+	{
+		entries[i].key = NULL;
+		entries[i].value = NIL_VAL;
+	}
 
-	for (int i = 0; i < oldCapacity; i++)
+	for (int i = 0; i < table->capacity; i++)
 	{
-		Entry* entry = &old[i];
-		if (entry->key != NULL)
-		{
-			Entry* dest = FindEntry(adjusted, capacity, entry->key);
-			dest->key = entry->key;
-			dest->value = entry->value;
-			table->count++;
-		}
+		Entry* entry = &table->entries[i];
+		if (entry->key == NULL) continue;
+
+		int index = FindInsertSlot(control, capacity, entry->key->hash);
+		control[index] = HASH_FRAGMENT(entry->key->hash);
+		entries[index] = *entry;
 	}
 
-	FREE_ARRAY(Entry, old, oldCapacity);
+	FREE_ARRAY(vm, uint8_t, table->control, table->capacity);
+	FREE_ARRAY(vm, Entry, table->entries, table->capacity);
+	vm->memStats.tableBytes += TABLE_BYTES(capacity) - TABLE_BYTES(table->capacity);
+	table->control = control;
+	table->entries = entries;
+	table->capacity = capacity;
+	table->tombstones = 0;
 }
 
-bool TableSet(Table* table, ObjString* key, Value value)
+bool TableSet(VM* vm, Table* table, ObjString* key, Value value)
 {
-	if (table->count >= table->capacity * TABLE_MAX_LOAD)
+	int index = table->capacity > 0 ? FindEntry(table, key) : -1;
+	if (index != -1)
 	{
-		int capacity = GROW_CAPACITY(table->capacity);
-		AdjustCapacity(table, capacity);
+		table->entries[index].value = value;
+		return false;
 	}
 
-	Entry* entry = FindEntry(table->entries, table->capacity, key);
+	if (table->count + table->tombstones + 1 > TABLE_MAX_LOAD(table->capacity))
+	{
+		// Only grow if live entries need the room, otherwise rehashing just clears out the tombstones.
+		int capacity = table->capacity < TABLE_GROUP_SIZE ? TABLE_GROUP_SIZE : table->capacity;
+		if (table->count + 1 > TABLE_MAX_LOAD(capacity) / 2) capacity *= 2;
+		AdjustCapacity(vm, table, capacity);
+	}
 
-	bool isNewKey = entry->key == NULL;
-	// new and not a tombstone. Tombstones are already included in count so no need to increment if so
-	if (isNewKey && IS_NIL(entry->value)) { table->count++; }
+	index = FindInsertSlot(table->control, table->capacity, key->hash);
+	if (table->control[index] == TABLE_DELETED) table->tombstones--;
+	table->control[index] = HASH_FRAGMENT(key->hash);
+	table->entries[index].key = key;
+	table->entries[index].value = value;
+	table->count++;
+	return true;
+}
+
+void CopyTable(VM* vm, const Table* from, Table* to)
+{
+	if (from->capacity == 0) return;
 
-	entry->key = key;
-	entry->value = value;
-	return isNewKey;
+	// Both arrays are allocated before 'to' changes, a collection in between only sees the old table.
+	uint8_t* control = ALLOCATE(vm, uint8_t, from->capacity);
+	Entry* entries = ALLOCATE(vm, Entry, from->capacity);
+	memcpy(control, from->control, sizeof(uint8_t) * from->capacity);
+	memcpy(entries, from->entries, sizeof(Entry) * from->capacity);
+
+	FreeTable(vm, to);
+	to->control = control;
+	to->entries = entries;
+	to->count = from->count;
+	to->tombstones = from->tombstones;
+	to->capacity = from->capacity;
+	vm->memStats.tableBytes += TABLE_BYTES(to->capacity);
 }
 
-void TableAddAll(Table* from, Table* to)
+void TableAddAll(VM* vm, const Table* from, Table* to)
 {
 	for (int i = 0; i < from->capacity; i++)
 	{
-		Entry* entry = &from->entries[i];
+		const Entry* entry = &from->entries[i];
 		if (entry->key != NULL)
 		{
-			TableSet(to, entry->key, entry->value);
+			TableSet(vm, to, entry->key, entry->value);
 		}
 	}
 }
@@ -117,50 +216,84 @@ bool TableGet(Table* table, ObjString* key, Value* outValue)
 {
 	if (table->count == 0) { return false; }
 
-	Entry* entry = FindEntry(table->entries, table->capacity, key);
-	if (entry->key != NULL) { 
-		*outValue = entry->value; 
-		return true;
+	int index = FindEntry(table, key);
+	if (index == -1) { return false; }
+
+	*outValue = table->entries[index].value;
+	return true;
+}
+
+static void RemoveEntry(Table* table, int index)
+{
+	// Probing stops at groups that contain an empty slot so if this group has one nothing probes past it and
+	// the slot can be marked empty instead of leaving a tombstone.
+	int group = index & ~(TABLE_GROUP_SIZE - 1);
+	if (MatchGroup(&table->control[group], TABLE_EMPTY) != 0)
+	{
+		table->control[index] = TABLE_EMPTY;
+	}
+	else
+	{
+		table->control[index] = TABLE_DELETED;
+		table->tombstones++;
 	}
 
-	return false;
+	table->entries[index].key = NULL;
+	table->entries[index].value = NIL_VAL;
+	table->count--;
 }
 
 bool TableDelete(Table* table, ObjString* key)
 {
 	if (table->count == 0) { return false; }
 
-	Entry* entry = FindEntry(table->entries, table->capacity, key);
+	int index = FindEntry(table, key);
+	if (index == -1) { return false; }
 
-	if (entry->key == NULL) { return false; }
+	RemoveEntry(table, index);
+	return true;
+}
 
-	// tombstone entry {NULL, true} or {NULL, non NIL_VAL}
-	entry->key = NULL;
-	entry->value = BOOL_VAL(true);
+void TableRemoveWhite(Table* table, bool keepOld)
+{
+	for (int i = 0; i < table->capacity; i++)
+	{
+		Entry* entry = &table->entries[i];
+		if (entry->key == NULL || entry->key->obj.isMarked || (keepOld && entry->key->obj.isOld)) continue;
+		RemoveEntry(table, i);
+	}
+}
 
-	return true;
+void MarkTable(VM* vm, Table* table)
+{
+	for (int i = 0; i < table->capacity; i++)
+	{
+		Entry* entry = &table->entries[i];
+		if (entry->key == NULL) continue;
+		MarkObject(vm, (Obj*)entry->key);
+		MarkValue(vm, entry->value);
+	}
 }
 
 ObjString* TableFindString(Table* table, const char* chars, int length, uint32_t hash)
 {
 	if (table->count == 0) return NULL;
 
-	int index = hash % table->capacity;
+	uint8_t fragment = HASH_FRAGMENT(hash);
+	int group = FirstGroup(hash, table->capacity);
 	while (true)
 	{
-		Entry* entry = &table->entries[index];
-		if (entry->key == NULL)
+		const uint8_t* control = &table->control[group];
+		for (unsigned int match = MatchGroup(control, fragment); match != 0; match &= match - 1)
 		{
-			if (IS_NIL(entry->value))
+			ObjString* key = table->entries[group + FirstBit(match)].key;
+			if (key->hash == hash && key->length == length && memcmp(key->chars, chars, length) == 0)
 			{
-				return NULL;
+				return key;
 			}
 		}
-		else if (entry->key->hash == hash && entry->key->length == length && memcmp(entry->key->chars, chars, length) == 0)
-		{
-			return entry->key;
-		}
 
-		index = (index + 1) % table->capacity;
+		if (MatchGroup(control, TABLE_EMPTY) != 0) return NULL;
+		group = NextGroup(group, table->capacity);
 	}
 }
@@ -10,19 +10,35 @@ typedef struct
 	Value value;
 } Entry;
 
+// Open addressing hash table probed in groups of TABLE_GROUP_SIZE slots. Each slot has a control byte holding 
+// 7 bits of its key's hash, or TABLE_EMPTY/TABLE_DELETED. Lookups compare a whole group of control bytes at 
+// once and only touch entries whose hash fragment matches. Unused entries have a NULL key.
+// Keys are compared by pointer, so they have to be interned strings, the ones CopyString() makes.
+#define TABLE_GROUP_SIZE 16
+#define TABLE_EMPTY 0x80
+#define TABLE_DELETED 0xFE
+
 typedef struct
 {
-	int count;
-	int capacity;
+	int count; // live entries
+	int tombstones;
+	int capacity; // 0 or a power of two >= TABLE_GROUP_SIZE
+	uint8_t* control;
 	Entry* entries;
 } Table;
 
 void InitTable(Table* table);
-void FreeTable(Table* table);
-bool TableSet(Table* table, ObjString* key, Value value);
-void TableAddAll(Table* from, Table* to);
+void FreeTable(VM* vm, Table* table);
+bool TableSet(VM* vm, Table* table, ObjString* key, Value value);
+void TableAddAll(VM* vm, const Table* from, Table* to);
+// Replaces 'to' with a copy of 'from', slot for slot. Much faster than TableAddAll() into an empty table.
+void CopyTable(VM* vm, const Table* from, Table* to);
 bool TableGet(Table* table, ObjString* key, Value* outValue);
 bool TableDelete(Table* table, ObjString* key);
 ObjString* TableFindString(Table* table, const char* chars, int length, uint32_t hash);
+// Removes every entry whose key wasn't marked by the collector. vm->strings doesn't keep its strings alive. A minor 
+// collection doesn't mark old objects, it passes 'keepOld' to leave them be.
+void TableRemoveWhite(Table* table, bool keepOld);
+void MarkTable(VM* vm, Table* table);
 
 #endif // !clox_table_h
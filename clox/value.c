@@ -11,33 +11,33 @@ void InitValueArray(ValueArray* arr)
 	arr->values = NULL;
 }
 
-void FreeValueArray(ValueArray* arr)
+void FreeValueArray(VM* vm, ValueArray* arr)
 {
-	FREE_ARRAY(Value, arr->values, arr->capacity);
+	FREE_ARRAY(vm, Value, arr->values, arr->capacity);
 	InitValueArray(arr);
 }
 
-void WriteValueArray(ValueArray* arr, Value value)
+void WriteValueArray(VM* vm, ValueArray* arr, Value value)
 {
 	if (arr->count >= arr->capacity)
 	{
 		int old_capacity = arr->capacity;
 		arr->capacity = GROW_CAPACITY(old_capacity);
-		arr->values = GROW_ARRAY(Value, arr->values, old_capacity, arr->capacity);
+		arr->values = GROW_ARRAY(vm, Value, arr->values, old_capacity, arr->capacity);
 	}
 
 	arr->values[arr->count] = value;
 	arr->count++;
 }
 
-void PrintValue(Value value)
+void PrintValue(VM* vm, Value value)
 {
 	switch (value.type)
 	{
 	case VAL_NUMBER: printf("%.2f", AS_NUMBER(value)); break;
 	case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false"); break;
 	case VAL_NIL: printf("nil"); break;
-	case VAL_OBJ: PrintObject(value); break;
+	case VAL_OBJ: PrintObject(vm, value); break;
 	default:
 		break;
 	}
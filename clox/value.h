@@ -49,9 +49,9 @@ typedef struct
 } ValueArray;
 
 void InitValueArray(ValueArray* arr);
-void FreeValueArray(ValueArray* arr);
-void WriteValueArray(ValueArray* arr, Value value);
+void FreeValueArray(VM* vm, ValueArray* arr);
+void WriteValueArray(VM* vm, ValueArray* arr, Value value);
 
-void PrintValue(Value value);
+void PrintValue(VM* vm, Value value);
 
 #endif // !clox_value_h
@@ -12,72 +12,146 @@
 #include "memory.h"
 #include "object.h"
 
-VM vm;
+// vm->globals isn't an object, so its write barrier just tells the next minor collection to scan the whole table.
+static bool SetGlobal(VM* vm, ObjString* name, Value value)
+{
+	bool isNewKey = TableSet(vm, &vm->globals, name, value);
+	if (!name->obj.isOld || (IS_OBJ(value) && !AS_OBJ(value)->isOld)) vm->globalsHaveYoung = true;
+	return isNewKey;
+}
 
-static void DefineNative(const char* name, NativeFn function)
+static void DefineNative(VM* vm, const char* name, NativeFn function)
 {
-	// TODO Come back to this after implementing GC, might make some sense why we need to push and pop.
-	// has something to do with ObjString.
+	// Both objects are kept on the stack so a collection started by the next allocation doesn't free them.
 	int nameLength = (int)strlen(name);
-	Push(OBJ_VAL(CopyString(name, nameLength)));
-	Push(OBJ_VAL(NewNative(function)));
-	TableSet(&vm.globals, AS_STRING(vm.stack.values[0]), vm.stack.values[1]);
-	Pop();
-	Pop();
+	Push(vm, OBJ_VAL(CopyString(vm, name, nameLength)));
+	Push(vm, OBJ_VAL(NewNative(vm, function)));
+	SetGlobal(vm, AS_STRING(vm->stack.values[0]), vm->stack.values[1]);
+	Pop(vm);
+	Pop(vm);
 }
 
-static Value ClockNative(int argCount, Value* args)
+static Value ClockNative(VM* vm, int argCount, Value* args)
 {
 	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-static void ResetStack()
+// memStats() returns nothing and prints every counter, memStats("name") returns that counter or nil if there's 
+// no such counter.
+static Value MemStatsNative(VM* vm, int argCount, Value* args)
 {
-	vm.stack.count = 0;
-	vm.frameCount = 0;
+	if (argCount == 0)
+	{
+		PrintMemStats(vm);
+		return NIL_VAL;
+	}
+
+	double value;
+	if (argCount == 1 && IS_STRING(args[0]) && GetMemStat(vm, AS_CSTRING(args[0]), &value)) return NUMBER_VAL(value);
+	return NIL_VAL;
 }
 
-void InitVM()
+static void ResetStack(VM* vm)
 {
-	InitValueArray(&vm.stack);
-	vm.objects = NULL;
-	InitTable(&vm.strings);
-	InitTable(&vm.globals);
-	DefineNative("clock", ClockNative);
+	vm->stack.count = 0;
+	vm->frameCount = 0;
 }
 
-void FreeVM()
+// Everything but the natives, which are globals like any other.
+static void InitVMState(VM* vm)
 {
-	FreeTable(&vm.strings);
-	FreeTable(&vm.globals);
-	FreeValueArray(&vm.stack);
-	FreeObjects();
+	SeedStringHash();
+	vm->objects = NULL;
+	vm->youngObjects = NULL;
+	vm->pushing = NIL_VAL;
+	vm->bytesAllocated = 0;
+	vm->maxHeap = SIZE_MAX;
+	vm->heapExhausted = false;
+	vm->reserve = NULL;
+	RecoverHeap(vm);
+	memset(&vm->memStats, 0, sizeof(MemStats));
+	vm->nextGC = 1024 * 1024;
+	vm->nurseryBytes = 0;
+	vm->collectingNursery = false;
+	vm->incrementalGC = false;
+	vm->gcSliceWork = 1000;
+	vm->gcPhase = GC_IDLE;
+	vm->nextSlice = 0;
+	vm->sweepCursor = NULL;
+	vm->grayCount = vm->grayCapacity = 0;
+	vm->grayStack = NULL;
+	vm->rememberedCount = vm->rememberedCapacity = 0;
+	vm->remembered = NULL;
+	vm->globalsHaveYoung = false;
+	memset(&vm->minorPauses, 0, sizeof(PauseHistogram));
+	memset(&vm->majorPauses, 0, sizeof(PauseHistogram));
+#ifdef POOL_ALLOCATOR
+	memset(&vm->pool, 0, sizeof(Pool));
+#endif
+	vm->parser = NULL;
+	vm->program = NULL;
+#ifdef DEBUG_STRESS_GC
+	vm->stressCollections = 0;
+#endif
+	vm->frameCount = 0;
+	InitValueArray(&vm->stack);
+	InitTable(&vm->strings);
+	InitTable(&vm->globals);
 }
 
+static void DefineNatives(VM* vm)
+{
+	DefineNative(vm, "clock", ClockNative);
+	DefineNative(vm, "memStats", MemStatsNative);
+}
 
-void Push(Value value)
+void InitVM(VM* vm)
 {
-	WriteValueArray(&vm.stack, value);
+	InitVMState(vm);
+	DefineNatives(vm);
 }
 
-Value Pop()
+void FreeVM(VM* vm)
 {
-	vm.stack.count--;
-	return vm.stack.values[vm.stack.count];
+	FreeTable(vm, &vm->strings);
+	FreeTable(vm, &vm->globals);
+	FreeValueArray(vm, &vm->stack);
+	FreeObjects(vm);
 }
 
-Value PopN(int n)
+
+void Push(VM* vm, Value value)
 {
-	vm.stack.count -= n;
-	return vm.stack.values[vm.stack.count];
+	if (vm->stack.count < vm->stack.capacity)
+	{
+		vm->stack.values[vm->stack.count++] = value;
+		return;
+	}
+
+	// Growing the stack can start a collection before 'value' is on it.
+	vm->pushing = value;
+	WriteValueArray(vm, &vm->stack, value);
+	vm->pushing = NIL_VAL;
 }
 
-Value Peek(int n)
+Value Pop(VM* vm)
 {
-	return vm.stack.values[vm.stack.count - 1 - n];
+	vm->stack.count--;
+	return vm->stack.values[vm->stack.count];
 }
 
-static void RuntimeError(const char* format, ...)
+Value PopN(VM* vm, int n)
+{
+	vm->stack.count -= n;
+	return vm->stack.values[vm->stack.count];
+}
+
+Value Peek(VM* vm, int n)
+{
+	return vm->stack.values[vm->stack.count - 1 - n];
+}
+
+static void RuntimeError(VM* vm, const char* format, ...)
 {
 	va_list args;
 	va_start(args, format);
@@ -85,18 +159,19 @@ static void RuntimeError(const char* format, ...)
 	va_end(args);
 	fputs("\n", stderr);
 
-	for (int i = vm.frameCount - 1; i >= 0; i--)
+	for (int i = vm->frameCount - 1; i >= 0; i--)
 	{
-		CallFrame* frame = &vm.frames[i];
+		CallFrame* frame = &vm->frames[i];
 		ObjFunction* function = frame->function;
-		size_t instruction_index = frame->ip - function->chunk.code - 1;
+		// A frame that was just called hasn't run an instruction yet, its line is the one the function starts on.
+		size_t instruction_index = frame->ip > function->chunk.code ? frame->ip - function->chunk.code - 1 : 0;
 		int line = GetLine(&function->chunk, instruction_index);
 		fprintf(stderr, "[line %d] in ", line);
 		if (function->name == NULL) fprintf(stderr, "script.\n");
 		else fprintf(stderr, "%s()\n", function->name->chars);
 	}
 
-	ResetStack();
+	ResetStack(vm);
 }
 
 static bool IsFalsey(Value value)
@@ -104,7 +179,7 @@ static bool IsFalsey(Value value)
 	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static bool ValuesEqual(Value a, Value b)
+static bool ValuesEqual(VM* vm, Value a, Value b)
 {
 	if (a.type != b.type)
 	{
@@ -118,7 +193,18 @@ static bool ValuesEqual(Value a, Value b)
 	case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
 	case VAL_NIL: return true;
 	case VAL_OBJ: {
-		return AS_OBJ(a) == AS_OBJ(b);
+		Obj* aObj = AS_OBJ(a);
+		Obj* bObj = AS_OBJ(b);
+		if (aObj == bObj) return true;
+		if (!IsStringValue(a) || !IsStringValue(b) || StringLength(aObj) != StringLength(bObj)) return false;
+
+		// Two interned strings are equal only if they are the same object. Strings made at runtime aren't 
+		// interned, so their characters are compared instead.
+		ObjString* aString = aObj->type == OBJ_ROPE ? FlattenRope(vm, (ObjRope*)aObj) : (ObjString*)aObj;
+		ObjString* bString = bObj->type == OBJ_ROPE ? FlattenRope(vm, (ObjRope*)bObj) : (ObjString*)bObj;
+		if (aString == bString) return true;
+		if (aString->interned && bString->interned) return false;
+		return memcmp(aString->chars, bString->chars, aString->length) == 0;
 		/*ObjString* aString = AS_STRING(a);
 		ObjString* bString = AS_STRING(b);
 		return aString->length == bString->length && memcmp(aString->chars, bString->chars, aString->length) == 0;*/
@@ -141,54 +227,129 @@ static bool ValuesEqual(Value a, Value b)
 //	// snprintf(buffer, size, "%f")
 //}
 
-static void Concatenate()
+// Both operands are strings or ropes. Short results are copied right away, long ones become a rope.
+static void Concatenate(VM* vm)
 {
-	ObjString* b = AS_STRING(Pop());
-	ObjString* a = AS_STRING(Pop());
+	Obj* b = AS_OBJ(Peek(vm, 0));
+	Obj* a = AS_OBJ(Peek(vm, 1));
+	int aLength = StringLength(a);
+	int bLength = StringLength(b);
+
+	Obj* result;
+	if (aLength == 0) result = b;
+	else if (bLength == 0) result = a;
+	else if (aLength + bLength >= ROPE_MIN_LENGTH) result = (Obj*)NewRope(vm, a, b);
+	else
+	{
+		// Ropes are never shorter than ROPE_MIN_LENGTH, so both of these are flat.
+		ObjString* aString = (ObjString*)a;
+		ObjString* bString = (ObjString*)b;
+		ObjString* concatenated = AllocateStringBuffer(vm, aLength + bLength);
+		memcpy(concatenated->chars, aString->chars, aLength);
+		memcpy(concatenated->chars + aLength, bString->chars, bLength);
+		result = (Obj*)TakeString(vm, concatenated);
+	}
 
-	int length = a->length + b->length;
-	char* concatChars = ALLOCATE(char, length + 1);
-	memcpy(concatChars, a->chars, a->length);
-	memcpy(concatChars + a->length, b->chars, b->length);
-	concatChars[length] = '\0';
+	PopN(vm, 2);
+	Push(vm, OBJ_VAL(result));
+}
 
-	ObjString* concatenated = TakeString(concatChars, length);
-	Push(OBJ_VAL(concatenated));
+static bool IsShortString(Obj* string)
+{
+	return string->type == OBJ_STRING && ((ObjString*)string)->length < ROPE_MIN_LENGTH;
 }
 
-static bool Call(ObjFunction* function, int argCount)
+// Copies operands[start, end) into one string.
+static ObjString* JoinStrings(VM* vm, Value* operands, int start, int end)
+{
+	int length = 0;
+	for (int i = start; i < end; i++) length += AS_STRING(operands[i])->length;
+
+	ObjString* joined = AllocateStringBuffer(vm, length);
+	char* chars = joined->chars;
+	for (int i = start; i < end; i++)
+	{
+		ObjString* operand = AS_STRING(operands[i]);
+		memcpy(chars, operand->chars, operand->length);
+		chars += operand->length;
+	}
+	return TakeString(vm, joined);
+}
+
+// Joins the top 'count' values, which are all strings or ropes. Each run of short strings is copied into a single 
+// buffer, and runs are chained to long strings and ropes with rope nodes. A short result is therefore one 
+// allocation, whatever the number of operands.
+static void ConcatenateN(VM* vm, int count)
+{
+	// The result so far and the piece being added to it are kept on the stack, above the operands, since making 
+	// the next piece or rope can start a collection.
+	int first = vm->stack.count - count;
+	Push(vm, NIL_VAL);
+	Push(vm, NIL_VAL);
+	int resultSlot = vm->stack.count - 2;
+	int pieceSlot = vm->stack.count - 1;
+
+	for (int i = 0; i < count;)
+	{
+		Obj* piece = AS_OBJ(vm->stack.values[first + i]);
+		if (IsShortString(piece))
+		{
+			int end = i + 1;
+			while (end < count && IsShortString(AS_OBJ(vm->stack.values[first + end]))) end++;
+			if (end - i > 1) piece = (Obj*)JoinStrings(vm, &vm->stack.values[first], i, end);
+			i = end;
+		}
+		else
+		{
+			i++;
+		}
+		vm->stack.values[pieceSlot] = OBJ_VAL(piece);
+
+		// Runs are separated by long strings or ropes, so a rope made here is never shorter than ROPE_MIN_LENGTH.
+		Value result = vm->stack.values[resultSlot];
+		if (IS_NIL(result) || StringLength(AS_OBJ(result)) == 0) result = OBJ_VAL(piece);
+		else if (StringLength(piece) != 0) result = OBJ_VAL(NewRope(vm, AS_OBJ(result), piece));
+		vm->stack.values[resultSlot] = result;
+	}
+
+	Value result = vm->stack.values[resultSlot];
+	PopN(vm, count + 2);
+	Push(vm, result);
+}
+
+static bool Call(VM* vm, ObjFunction* function, int argCount)
 {
 	if (argCount != function->arity)
 	{
-		RuntimeError("Expected %d arguments but got %d instead.", function->arity, argCount);
+		RuntimeError(vm, "Expected %d arguments but got %d instead.", function->arity, argCount);
 		return false;
 	}
 
-	if (vm.frameCount >= FRAMES_MAX)
+	if (vm->frameCount >= FRAMES_MAX)
 	{
-		RuntimeError("Stack overflow.");
+		RuntimeError(vm, "Stack overflow.");
 		return false;
 	}
 
-	CallFrame* frame = &vm.frames[vm.frameCount++];
+	CallFrame* frame = &vm->frames[vm->frameCount++];
 	frame->function = function;
 	frame->ip = function->chunk.code;
-	frame->slotsBeginIndex = vm.stack.count - argCount - 1; // -1 to skip over local slot zero which contains func being called
+	frame->slotsBeginIndex = vm->stack.count - argCount - 1; // -1 to skip over local slot zero which contains func being called
 	return true;
 }
 
-static bool CallValue(Value callee, int argCount)
+static bool CallValue(VM* vm, Value callee, int argCount)
 {
 	if (IS_OBJ(callee))
 	{
 		switch (OBJ_TYPE(callee))
 		{
-		case OBJ_FUNCTION: return Call(AS_FUNCTION(callee), argCount);
+		case OBJ_FUNCTION: return Call(vm, AS_FUNCTION(callee), argCount);
 		case OBJ_NATIVE: {
 			NativeFn native = AS_NATIVE(callee);
-			Value* argsBegin = &vm.stack.values[vm.stack.count - argCount - 1];
-			Value result = native(argCount, argsBegin);
-			Push(result);
+			Value result = native(vm, argCount, &vm->stack.values[vm->stack.count - argCount]);
+			PopN(vm, argCount + 1); // the arguments and the native itself
+			Push(vm, result);
 			return true;
 		}
 		default:
@@ -196,13 +357,14 @@ static bool CallValue(Value callee, int argCount)
 		}
 	}
 
-	RuntimeError("Can only call functions and classes.");
+	RuntimeError(vm, "Can only call functions and classes.");
 	return false;
 }
 
-static InterpretResult Run()
+// Runs until the frame at 'baseFrameCount' returns and leaves its result on the stack.
+static InterpretResult Run(VM* vm, int baseFrameCount)
 {
-	CallFrame* frame = &vm.frames[vm.frameCount - 1];
+	CallFrame* frame = &vm->frames[vm->frameCount - 1];
 
 #define READ_BYTE() (*frame->ip++)
 #define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])	
@@ -210,59 +372,100 @@ static InterpretResult Run()
 // could get called before READ_BYTE() corresponding to READ_BYTE() << 8. Not good.
 #define READ_LONG_INDEX() (frame->ip += 3, frame->ip[-3] | (frame->ip[-2] << 8) | (frame->ip[-1] << 16)) 
 #define READ_CONSTANT_LONG() (frame->function->chunk.constants.values[READ_LONG_INDEX()])
-#define PEEK_TOP() (vm.stack.values[vm.stack.count - 1])
+#define PEEK_TOP() (vm->stack.values[vm->stack.count - 1])
 #define BINARY_OP(convertFunc, resultType, op) \
 	do { \
-		assert(vm.stack.count > 1 && "Binary operator requires 2+ values on the stack."); \
-		if( !IS_NUMBER(Peek(0)) || !IS_NUMBER(Peek(1)) ) {\
-			RuntimeError("Binary operator requires number operands."); \
+		assert(vm->stack.count > 1 && "Binary operator requires 2+ values on the stack."); \
+		if( !IS_NUMBER(Peek(vm, 0)) || !IS_NUMBER(Peek(vm, 1)) ) {\
+			RuntimeError(vm, "Binary operator requires number operands."); \
 			return INTERPRET_RUNTIME_ERROR; \
 		} \
-		double b = AS_NUMBER(Pop()); \
+		double b = AS_NUMBER(Pop(vm)); \
 		convertFunc(PEEK_TOP()) = AS_NUMBER(PEEK_TOP()) op b; \
 		PEEK_TOP().type = resultType; \
 	} while (false) 
 
+// Applies 'op' to the variable pointed at by 'target' and the value on top of the stack. The top of the stack 
+// is replaced with the result, which is also stored back into 'target'.
+#define IN_PLACE_OP(target, op) \
+	do { \
+		if( !IS_NUMBER(*(target)) || !IS_NUMBER(PEEK_TOP()) ) {\
+			RuntimeError(vm, "Binary operator requires number operands."); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+		AS_NUMBER(*(target)) = AS_NUMBER(*(target)) op AS_NUMBER(PEEK_TOP()); \
+		PEEK_TOP() = *(target); \
+	} while (false)
+#define READ_GLOBAL(name, outValue) \
+	do { \
+		if (!TableGet(&vm->globals, name, outValue)) { \
+			RuntimeError(vm, "Undefined variable '%s'.", name->chars); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+	} while (false)
+
+// Operands are known to be numbers, see SpecializeNumberOps().
+#define NUMBER_OP(convertFunc, op) \
+	do { \
+		double b = AS_NUMBER(Pop(vm)); \
+		PEEK_TOP() = convertFunc(AS_NUMBER(PEEK_TOP()) op b); \
+	} while (false)
+#define NUMBER_LOCAL_OP(op) \
+	do { \
+		Value* local = &vm->stack.values[frame->slotsBeginIndex + READ_BYTE()]; \
+		AS_NUMBER(*local) = AS_NUMBER(*local) op AS_NUMBER(PEEK_TOP()); \
+		PEEK_TOP() = *local; \
+	} while (false)
+
 #define BINARY_OP_CMP(op) BINARY_OP(AS_BOOL, VAL_BOOL, op)
 #define BINARY_OP_MATH(op) BINARY_OP(AS_NUMBER, VAL_NUMBER, op)
 #define READ_STRING(index) AS_STRING(frame->function->chunk.constants.values[index])
+#define CHECK_HEAP() \
+	do { \
+		if (vm->heapExhausted) \
+		{ \
+			if (vm->bytesAllocated <= vm->maxHeap) RuntimeError(vm, "Out of memory."); \
+			else RuntimeError(vm, "Out of memory, the heap limit is %zu bytes.", vm->maxHeap); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+	} while (false)
 
 	while (true)
 	{
 #ifdef DEBUG_TRACE_EXECUTION
 		printf("		");
-		for (int i = 0; i < vm.stack.count; i++)
+		for (int i = 0; i < vm->stack.count; i++)
 		{
 			printf("[ ");
-			PrintValue(vm.stack.values[i]);
+			PrintValue(vm, vm->stack.values[i]);
 			printf(" ]");
 		}
 		printf("\n");
-		DisassembleInstruction(&frame->function->chunk, (int)(frame->ip - frame->function->chunk.code));
+		DisassembleInstruction(vm, &frame->function->chunk, (int)(frame->ip - frame->function->chunk.code));
 #endif
 		uint8_t instruction;
 		switch (instruction = READ_BYTE())
 		{
 		case OP_CONSTANT: {
 			Value constant = READ_CONSTANT();
-			Push(constant);
+			Push(vm, constant);
 			break;
 		}
 		case OP_CONSTANT_LONG: {
 			Value constant = READ_CONSTANT_LONG();
-			Push(constant);
+			Push(vm, constant);
 			break;
 		}
 		case OP_NIL: {
-			Push(NIL_VAL);
+			Push(vm, NIL_VAL);
 			break;
 		}
 		case OP_TRUE: {
-			Push(BOOL_VAL(true));
+			Push(vm, BOOL_VAL(true));
 			break;
 		}
 		case OP_FALSE: {
-			Push(BOOL_VAL(false));
+			Push(vm, BOOL_VAL(false));
 			break;
 		}
 		case OP_NOT: {
@@ -273,9 +476,9 @@ static InterpretResult Run()
 		}
 		case OP_NEGATE:
 		{
-			if (!IS_NUMBER(Peek(0)))
+			if (!IS_NUMBER(Peek(vm, 0)))
 			{
-				RuntimeError("Negate operand must be a number.");
+				RuntimeError(vm, "Negate operand must be a number.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			AS_NUMBER(PEEK_TOP()) = -AS_NUMBER(PEEK_TOP());
@@ -283,22 +486,23 @@ static InterpretResult Run()
 		}
 		case OP_EQUAL_SWITCH:
 		{
-			PEEK_TOP().as.boolean = ValuesEqual(Peek(0), Peek(1));
+			PEEK_TOP().as.boolean = ValuesEqual(vm, Peek(vm, 0), Peek(vm, 1));
 			PEEK_TOP().type = VAL_BOOL;
 			break;
 		}
 		case OP_EQUAL:
 		{
-			Value b = Pop();
-			PEEK_TOP().as.boolean = ValuesEqual(PEEK_TOP(), b);
-			PEEK_TOP().type = VAL_BOOL;
+			// Both operands stay on the stack while comparing, flattening a rope allocates.
+			bool equal = ValuesEqual(vm, Peek(vm, 1), Peek(vm, 0));
+			Pop(vm);
+			PEEK_TOP() = BOOL_VAL(equal);
 			break;
 		}
 		case OP_NOT_EQUAL:
 		{
-			Value b = Pop();
-			PEEK_TOP().as.boolean = !ValuesEqual(PEEK_TOP(), b);
-			PEEK_TOP().type = VAL_BOOL;
+			bool equal = ValuesEqual(vm, Peek(vm, 1), Peek(vm, 0));
+			Pop(vm);
+			PEEK_TOP() = BOOL_VAL(!equal);
 			break;
 		}
 		case OP_GREATER:
@@ -323,13 +527,48 @@ static InterpretResult Run()
 		}
 		case OP_ADD:
 		{
-			if (IS_STRING(Peek(0)) && IS_STRING(Peek(1)))
+			if (IsStringValue(Peek(vm, 0)) && IsStringValue(Peek(vm, 1)))
 			{
-				Concatenate();
+				Concatenate(vm);
+				CHECK_HEAP();
 			}
 			else { BINARY_OP_MATH(+); }
 			break;
 		}
+		case OP_ADD_N:
+		{
+			int count = READ_BYTE();
+			Value* operands = &vm->stack.values[vm->stack.count - count];
+			bool strings = true;
+			bool numbers = true;
+			for (int i = 0; i < count; i++)
+			{
+				strings = strings && IsStringValue(operands[i]);
+				numbers = numbers && IS_NUMBER(operands[i]);
+			}
+
+			if (strings)
+			{
+				ConcatenateN(vm, count);
+				CHECK_HEAP();
+			}
+			else if (numbers)
+			{
+				// Summed left to right, the same order the chain of '+' would have used.
+				double sum = AS_NUMBER(operands[0]);
+				for (int i = 1; i < count; i++) sum += AS_NUMBER(operands[i]);
+				PopN(vm, count - 1);
+				PEEK_TOP() = NUMBER_VAL(sum);
+			}
+			else
+			{
+				// Number + number stays a number and string + string stays a string, so any mix fails somewhere 
+				// along the chain.
+				RuntimeError(vm, "Binary operator requires number operands.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			break;
+		}
 		case OP_SUB:
 		{
 			BINARY_OP_MATH(-);
@@ -347,41 +586,42 @@ static InterpretResult Run()
 		}
 		case OP_PRINT:
 		{
-			PrintValue(Pop());
+			PrintValue(vm, PEEK_TOP());
 			printf("\n");
+			Pop(vm);
 			break;
 		}
-		case OP_POP: { Pop(); break; }
+		case OP_POP: { Pop(vm); break; }
 		case OP_POPN:
 		{
-			PopN(READ_BYTE());
+			PopN(vm, READ_BYTE());
 			break;
 		}
 		case OP_DEFINE_GLOBAL:
 		{
 			ObjString* name = READ_STRING(READ_BYTE());
-			TableSet(&vm.globals, name, PEEK_TOP());
-			Pop();
+			SetGlobal(vm, name, PEEK_TOP());
+			Pop(vm);
 			break;
 		}
 		case OP_DEFINE_GLOBAL_LONG:
 		{
 			ObjString* name = READ_STRING(READ_LONG_INDEX());
-			TableSet(&vm.globals, name, PEEK_TOP());
-			Pop();
+			SetGlobal(vm, name, PEEK_TOP());
+			Pop(vm);
 			break;
 		}
 		case OP_GET_GLOBAL:
 		{
 			ObjString* name = READ_STRING(READ_BYTE());
 			Value toPush;
-			if (TableGet(&vm.globals, name, &toPush))
+			if (TableGet(&vm->globals, name, &toPush))
 			{
-				Push(toPush);
+				Push(vm, toPush);
 			}
 			else
 			{
-				RuntimeError("Undefined variable '%s'.", name->chars);
+				RuntimeError(vm, "Undefined variable '%s'.", name->chars);
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			break;
@@ -390,13 +630,13 @@ static InterpretResult Run()
 		{
 			ObjString* name = READ_STRING(READ_LONG_INDEX());
 			Value toPush;
-			if (TableGet(&vm.globals, name, &toPush))
+			if (TableGet(&vm->globals, name, &toPush))
 			{
-				Push(toPush);
+				Push(vm, toPush);
 			}
 			else
 			{
-				RuntimeError("Undefined variable '%s'.", name->chars);
+				RuntimeError(vm, "Undefined variable '%s'.", name->chars);
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			break;
@@ -404,10 +644,21 @@ static InterpretResult Run()
 		case OP_SET_GLOBAL:
 		{
 			ObjString* name = READ_STRING(READ_BYTE());
-			if (TableSet(&vm.globals, name, PEEK_TOP())) 
+			if (SetGlobal(vm, name, PEEK_TOP())) 
+			{
+				TableDelete(&vm->globals, name);
+				RuntimeError(vm, "Undefined variable '%s'.", name->chars);
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			break;
+		}
+		case OP_SET_GLOBAL_LONG:
+		{
+			ObjString* name = READ_STRING(READ_LONG_INDEX());
+			if (SetGlobal(vm, name, PEEK_TOP()))
 			{
-				TableDelete(&vm.globals, name);
-				RuntimeError("Undefined variable '%s'.", name->chars);
+				TableDelete(&vm->globals, name);
+				RuntimeError(vm, "Undefined variable '%s'.", name->chars);
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			break;
@@ -415,26 +666,135 @@ static InterpretResult Run()
 		case OP_GET_LOCAL:
 		{
 			// Push(frame->slots[READ_BYTE()]);
-			Push(vm.stack.values[frame->slotsBeginIndex + READ_BYTE()]);
+			Push(vm, vm->stack.values[frame->slotsBeginIndex + READ_BYTE()]);
 			break;
 		}
 		case OP_GET_LOCAL_LONG:
 		{
 			// Push(frame->slots[READ_LONG_INDEX()]);
-			Push(vm.stack.values[frame->slotsBeginIndex + READ_LONG_INDEX()]);
+			Push(vm, vm->stack.values[frame->slotsBeginIndex + READ_LONG_INDEX()]);
 			break;
 		}
 		case OP_SET_LOCAL:
 		{
-			vm.stack.values[frame->slotsBeginIndex + READ_BYTE()] = PEEK_TOP();
+			vm->stack.values[frame->slotsBeginIndex + READ_BYTE()] = PEEK_TOP();
 			break;
 		}
 		case OP_SET_LOCAL_LONG:
 		{
-			Value* local = &vm.stack.values[READ_LONG_INDEX()];
+			Value* local = &vm->stack.values[frame->slotsBeginIndex + READ_LONG_INDEX()];
 			*local = PEEK_TOP();
 			break;
 		}
+		case OP_ADD_LOCAL:
+		{
+			Value* local = &vm->stack.values[frame->slotsBeginIndex + READ_BYTE()];
+			if (IsStringValue(*local) && IsStringValue(PEEK_TOP()))
+			{
+				Value b = Pop(vm);
+				Push(vm, *local);
+				Push(vm, b);
+				Concatenate(vm);
+				local = &vm->stack.values[frame->slotsBeginIndex + frame->ip[-1]]; // stack may have been resized
+				*local = PEEK_TOP();
+				CHECK_HEAP();
+			}
+			else { IN_PLACE_OP(local, +); }
+			break;
+		}
+		case OP_SUB_LOCAL:
+		{
+			Value* local = &vm->stack.values[frame->slotsBeginIndex + READ_BYTE()];
+			IN_PLACE_OP(local, -);
+			break;
+		}
+		case OP_MULT_LOCAL:
+		{
+			Value* local = &vm->stack.values[frame->slotsBeginIndex + READ_BYTE()];
+			IN_PLACE_OP(local, *);
+			break;
+		}
+		case OP_DIV_LOCAL:
+		{
+			Value* local = &vm->stack.values[frame->slotsBeginIndex + READ_BYTE()];
+			IN_PLACE_OP(local, /);
+			break;
+		}
+		case OP_INCREMENT_LOCAL:
+		{
+			Value* local = &vm->stack.values[frame->slotsBeginIndex + READ_BYTE()];
+			int8_t delta = (int8_t)READ_BYTE();
+			if (!IS_NUMBER(*local))
+			{
+				RuntimeError(vm, "Increment operand must be a number.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			Value old = *local;
+			AS_NUMBER(*local) += delta;
+			Push(vm, old);
+			break;
+		}
+		case OP_ADD_GLOBAL:
+		{
+			ObjString* name = READ_STRING(READ_BYTE());
+			Value global;
+			READ_GLOBAL(name, &global);
+			if (IsStringValue(global) && IsStringValue(PEEK_TOP()))
+			{
+				Value b = Pop(vm);
+				Push(vm, global);
+				Push(vm, b);
+				Concatenate(vm);
+				CHECK_HEAP();
+				global = PEEK_TOP();
+			}
+			else { IN_PLACE_OP(&global, +); }
+			SetGlobal(vm, name, global);
+			break;
+		}
+		case OP_SUB_GLOBAL:
+		{
+			ObjString* name = READ_STRING(READ_BYTE());
+			Value global;
+			READ_GLOBAL(name, &global);
+			IN_PLACE_OP(&global, -);
+			SetGlobal(vm, name, global);
+			break;
+		}
+		case OP_MULT_GLOBAL:
+		{
+			ObjString* name = READ_STRING(READ_BYTE());
+			Value global;
+			READ_GLOBAL(name, &global);
+			IN_PLACE_OP(&global, *);
+			SetGlobal(vm, name, global);
+			break;
+		}
+		case OP_DIV_GLOBAL:
+		{
+			ObjString* name = READ_STRING(READ_BYTE());
+			Value global;
+			READ_GLOBAL(name, &global);
+			IN_PLACE_OP(&global, /);
+			SetGlobal(vm, name, global);
+			break;
+		}
+		case OP_INCREMENT_GLOBAL:
+		{
+			ObjString* name = READ_STRING(READ_BYTE());
+			int8_t delta = (int8_t)READ_BYTE();
+			Value global;
+			READ_GLOBAL(name, &global);
+			if (!IS_NUMBER(global))
+			{
+				RuntimeError(vm, "Increment operand must be a number.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			Push(vm, global);
+			AS_NUMBER(global) += delta;
+			SetGlobal(vm, name, global);
+			break;
+		}
 		case OP_JUMP:
 		{
 			int offset = READ_LONG_INDEX();
@@ -463,32 +823,78 @@ static InterpretResult Run()
 		{
 			int offset = READ_LONG_INDEX();
 			frame->ip -= offset;
+			CHECK_HEAP();
+			break;
+		}
+		case OP_JUMP_BACK_IF_TRUE:
+		{
+			int offset = READ_LONG_INDEX();
+			if (!IsFalsey(Pop(vm)))
+			{
+				frame->ip -= offset;
+				CHECK_HEAP();
+			}
 			break;
 		}
 		case OP_CALL:
 		{
 			int argCount = READ_BYTE();
-			if (!CallValue(Peek(argCount), argCount))
+			if (!CallValue(vm, Peek(vm, argCount), argCount))
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &vm.frames[vm.frameCount - 1];
+			frame = &vm->frames[vm->frameCount - 1];
+			CHECK_HEAP();
 			break;
 		}
 		case OP_RETURN:
 		{
-			Value result = Pop();
-			vm.frameCount--;
-			if (vm.frameCount == 0) { // "returned" from the script
-				Pop();
-				return INTERPRET_OK;
-			}
+			Value result = Pop(vm);
+			vm->frameCount--;
 			
-			// int localsToPop = &vm.stack.values[vm.stack.count - 1] - frame->slots + 1; 
-			vm.stack.count = frame->slotsBeginIndex;
-			Push(result);
+			// int localsToPop = &vm->stack.values[vm->stack.count - 1] - frame->slots + 1; 
+			vm->stack.count = frame->slotsBeginIndex;
+			Push(vm, result);
+			// "returned" from the script, or from the function CallFunction() called
+			if (vm->frameCount == baseFrameCount) return INTERPRET_OK;
 
-			frame = &vm.frames[vm.frameCount - 1];
+			frame = &vm->frames[vm->frameCount - 1];
+			break;
+		}
+		case OP_NEGATE_NUMBER:
+		{
+			AS_NUMBER(PEEK_TOP()) = -AS_NUMBER(PEEK_TOP());
+			break;
+		}
+		case OP_GREATER_NUMBER: NUMBER_OP(BOOL_VAL, >); break;
+		case OP_GREATER_EQUAL_NUMBER: NUMBER_OP(BOOL_VAL, >=); break;
+		case OP_LESS_NUMBER: NUMBER_OP(BOOL_VAL, <); break;
+		case OP_LESS_EQUAL_NUMBER: NUMBER_OP(BOOL_VAL, <=); break;
+		case OP_ADD_NUMBER: NUMBER_OP(NUMBER_VAL, +); break;
+		case OP_SUB_NUMBER: NUMBER_OP(NUMBER_VAL, -); break;
+		case OP_MULT_NUMBER: NUMBER_OP(NUMBER_VAL, *); break;
+		case OP_DIV_NUMBER: NUMBER_OP(NUMBER_VAL, /); break;
+		case OP_ADD_N_NUMBER:
+		{
+			int count = READ_BYTE();
+			Value* operands = &vm->stack.values[vm->stack.count - count];
+			double sum = AS_NUMBER(operands[0]);
+			for (int i = 1; i < count; i++) sum += AS_NUMBER(operands[i]);
+			PopN(vm, count - 1);
+			PEEK_TOP() = NUMBER_VAL(sum);
+			break;
+		}
+		case OP_ADD_LOCAL_NUMBER: NUMBER_LOCAL_OP(+); break;
+		case OP_SUB_LOCAL_NUMBER: NUMBER_LOCAL_OP(-); break;
+		case OP_MULT_LOCAL_NUMBER: NUMBER_LOCAL_OP(*); break;
+		case OP_DIV_LOCAL_NUMBER: NUMBER_LOCAL_OP(/); break;
+		case OP_INCREMENT_LOCAL_NUMBER:
+		{
+			Value* local = &vm->stack.values[frame->slotsBeginIndex + READ_BYTE()];
+			int8_t delta = (int8_t)READ_BYTE();
+			Value old = *local;
+			AS_NUMBER(*local) += delta;
+			Push(vm, old);
 			break;
 		}
 		default:
@@ -503,29 +909,148 @@ static InterpretResult Run()
 #undef PEEK_TOP
 #undef BINARY_OP
 #undef BINARY_OP_CMP
+#undef IN_PLACE_OP
+#undef NUMBER_OP
+#undef NUMBER_LOCAL_OP
+#undef READ_GLOBAL
 #undef BINARY_OP_MATH
 #undef READ_STRING
+#undef CHECK_HEAP
 }
 
-InterpretResult Interpret(const char* source)
+static InterpretResult RunScript(VM* vm, ObjFunction* function)
+{
+	/*CallFrame* frame = &vm->frames[vm->frameCount++];
+	frame->function = function;
+	frame->ip = function->chunk.code;
+	frame->slots = vm->stack.values;*/
+
+	Push(vm, OBJ_VAL(function));
+	Call(vm, function, 0); // "call" script
+
+	InterpretResult result = Run(vm, 0);
+	if (result == INTERPRET_OK) Pop(vm); // the script's nil
+	return result;
+}
+
+InterpretResult Interpret(VM* vm, const char* source)
 {	
-	ObjFunction* function = Compile(source);
+	ObjFunction* function = Compile(vm, source);
 	if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
-	/*CallFrame* frame = &vm.frames[vm.frameCount++];
-	frame->function = function;
-	frame->ip = function->chunk.code;
-	frame->slots = vm.stack.values;*/
+	return RunScript(vm, function);
+}
+
+bool GetGlobal(VM* vm, const char* name, Value* value)
+{
+	// Looked up without interning, a name that isn't interned can't be a global.
+	int length = (int)strlen(name);
+	ObjString* key = TableFindString(&vm->strings, name, length, HashString(name, length));
+	return key != NULL && TableGet(&vm->globals, key, value);
+}
+
+InterpretResult CallFunction(VM* vm, Value function, int argCount, const Value* args, Value* result)
+{
+	assert(vm->frameCount == 0 && "Can't call into the VM while it is running.");
+	RecoverHeap(vm);
+
+	Push(vm, function);
+	for (int i = 0; i < argCount; i++) Push(vm, args[i]);
+	if (!CallValue(vm, function, argCount)) return INTERPRET_RUNTIME_ERROR;
+
+	// Natives are done already, functions leave their frame to Run().
+	if (vm->frameCount > 0)
+	{
+		InterpretResult status = Run(vm, 0);
+		if (status != INTERPRET_OK) return status;
+	}
+
+	*result = Pop(vm);
+	return INTERPRET_OK;
+}
+
+bool CompileProgram(Program* program, const char* source)
+{
+	InitVM(&program->owner);
+	program->function = Compile(&program->owner, source);
+	if (program->function == NULL)
+	{
+		FreeVM(&program->owner);
+		return false;
+	}
+
+	FreezeObjects(&program->owner);
+	return true;
+}
 
-	Push(OBJ_VAL(function));
-	Call(function, 0); // "call" script
+void FreeProgram(Program* program)
+{
+	FreeVM(&program->owner);
+	program->function = NULL;
+}
+
+void InitProgramVM(VM* vm, const Program* program)
+{
+	// The program's strings are interned before anything else, so strings this VM makes compare equal to them.
+	InitVMState(vm);
+	CopyTable(vm, &program->owner.strings, &vm->strings);
+	DefineNatives(vm);
+	vm->program = program;
+}
+
+InterpretResult RunProgram(VM* vm, const Program* program)
+{
+	if (vm->program != program)
+	{
+		fprintf(stderr, "The VM was set up for another program, see InitProgramVM().\n");
+		return INTERPRET_RUNTIME_ERROR;
+	}
+
+	// The error stopped the job that used up the heap, the next one gets to try again.
+	RecoverHeap(vm);
+	return RunScript(vm, program->function);
+}
+
+InterpretResult TakeSnapshot(Snapshot* snapshot, const char* prelude)
+{
+	VM* vm = &snapshot->owner;
+	InitVM(vm);
+	InterpretResult result = Interpret(vm, prelude);
+	if (result != INTERPRET_OK)
+	{
+		FreeVM(vm);
+		return result;
+	}
+
+	// Flattening a rope writes to it, so it's done here once instead of by every clone that reads it. The globals 
+	// are the only roots left, ropes that are only reachable from other ropes are never read on their own.
+	for (int i = 0; i < vm->globals.capacity; i++)
+	{
+		Entry* entry = &vm->globals.entries[i];
+		if (entry->key != NULL && IS_ROPE(entry->value)) FlattenRope(vm, AS_ROPE(entry->value));
+	}
 
-	return Run();
+	// Leaves only what the globals reach to be frozen.
+	CollectGarbage(vm);
+	FreezeObjects(vm);
+	return INTERPRET_OK;
+}
+
+void FreeSnapshot(Snapshot* snapshot)
+{
+	FreeVM(&snapshot->owner);
+}
+
+void InitVMFromSnapshot(VM* vm, const Snapshot* snapshot)
+{
+	InitVMState(vm);
+	CopyTable(vm, &snapshot->owner.strings, &vm->strings);
+	CopyTable(vm, &snapshot->owner.globals, &vm->globals); // natives included
 }
 
 //InterpretResult Interpret(Chunk* chunk)
 //{
-//	vm.chunk = chunk;
-//	vm.ip = chunk->code;
+//	vm->chunk = chunk;
+//	vm->ip = chunk->code;
 //	return Run();
 //}
@@ -2,6 +2,7 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -12,12 +13,12 @@ typedef struct
 {
 	ObjFunction* function;
 	uint8_t* ip; // function's own ip. return is handled by the vm, not by callframe
-	// points to where function's locals start somewhere in vm.stack. Can't be a pointer b/c stack is resizing array. Pointers get 
+	// points to where function's locals start somewhere in vm->stack. Can't be a pointer b/c stack is resizing array. Pointers get 
 	// invalidated.
 	size_t slotsBeginIndex; 
 } CallFrame;
 
-typedef struct
+struct VM
 {
 	CallFrame frames[FRAMES_MAX];
 	int frameCount; // # of ongoing functions
@@ -25,10 +26,53 @@ typedef struct
 	// uint8_t* ip; // instruction pointer
 	// Value stack[STACK_MAX];
 	ValueArray stack;
-	Table strings;
+	Table strings; // weak, see TableRemoveWhite()
 	Table globals;
-	Obj* objects;
-} VM;
+	Obj* objects; // old generation
+	Obj* youngObjects; // allocated since the last collection
+	Value pushing; // value being pushed while the stack grows, see Push()
+
+	size_t bytesAllocated;
+	// Soft limit on bytesAllocated, SIZE_MAX for none. Going over it starts a full collection, and if that doesn't 
+	// bring the heap back under the limit 'heapExhausted' is set. Run() then stops the script with a runtime error 
+	// at the next backward jump, call or string concatenation.
+	size_t maxHeap;
+	// Also set when malloc itself fails, the reserve makes sure the script can still be stopped cleanly.
+	bool heapExhausted;
+	void* reserve; // HEAP_RESERVE_SIZE bytes of malloc memory, NULL once given up
+	size_t nextGC; // major collection once bytesAllocated goes over this
+	size_t nurseryBytes; // bytes of young objects, a minor collection runs once this gets big enough
+	bool collectingNursery;
+	bool incrementalGC;
+	int gcSliceWork; // objects marked or swept per incremental slice
+	GCPhase gcPhase;
+	size_t nextSlice; // bytesAllocated at which the running cycle does its next slice
+	Obj* sweepCursor; // last object the sweep phase kept, NULL while it is still at the head of vm->objects
+	int grayCount;
+	int grayCapacity;
+	Obj** grayStack; // allocated with plain realloc so marking never starts another collection
+
+	// Write barrier state. Old objects that were given a young reference, and whether vm->globals was.
+	int rememberedCount;
+	int rememberedCapacity;
+	Obj** remembered;
+	bool globalsHaveYoung;
+
+	MemStats memStats;
+	PauseHistogram minorPauses;
+	PauseHistogram majorPauses;
+
+#ifdef POOL_ALLOCATOR
+	Pool pool;
+#endif
+	struct Parser* parser; // compiler running on this VM, its functions are GC roots
+	// Program the VM was set up for by InitProgramVM(), NULL if none. Its globals are keyed by that program's 
+	// interned strings, so it can't run any other.
+	const struct Program* program;
+#ifdef DEBUG_STRESS_GC
+	int stressCollections;
+#endif
+};
 
 typedef enum {
 	INTERPRET_OK,
@@ -36,12 +80,56 @@ typedef enum {
 	INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+void InitVM(VM* vm);
+void FreeVM(VM* vm);
+InterpretResult Interpret(VM* vm, const char* source);
+
+/*
+	Embedding. Run a script once to define its functions, look up the ones to call with GetGlobal() and call 
+	them with CallFunction() as often as needed. Nothing gets scanned or compiled again. The script can be a 
+	Program, so one compilation serves many VMs.
+*/
+
+// Returns false if there is no global called 'name'.
+bool GetGlobal(VM* vm, const char* name, Value* value);
+// Calls a function or native from C, not from inside a native. Objects among 'args' have to be reachable already,
+// from a global or the VM's stack, and an object returned in 'result' is only safe until the VM allocates again.
+// A runtime error is reported like one in a script and leaves 'result' untouched.
+InterpretResult CallFunction(VM* vm, Value function, int argCount, const Value* args, Value* result);
+
+// A script compiled once and then run by any number of VMs, on as many threads. Its objects belong to 'owner' and
+// are frozen, see FreezeObjects(), so the VMs running it only ever read them.
+typedef struct Program
+{
+	VM owner; // nothing runs on it
+	ObjFunction* function;
+} Program;
+
+// Prints the compile errors and returns false if there are any.
+bool CompileProgram(Program* program, const char* source);
+// Only once no VM is running the program anymore.
+void FreeProgram(Program* program);
+// Sets up a VM that runs 'program' and no other. Names are looked up by the program's interned strings, which a 
+// second program doesn't share, so its globals and natives wouldn't be found and equal strings wouldn't compare 
+// equal. Interpret() still works on the VM, its source is interned against the same table.
+void InitProgramVM(VM* vm, const Program* program);
+// Fails with INTERPRET_RUNTIME_ERROR if the VM wasn't set up for 'program'.
+InterpretResult RunProgram(VM* vm, const Program* program);
+
+// A VM that ran a prelude, frozen like a Program's. VMs cloned from it start out with the prelude's globals and 
+// strings but share the objects they refer to, so a clone costs two table copies instead of a compile and a run. 
+// Whatever a clone assigns afterwards only changes its own globals.
+typedef struct
+{
+	VM owner; // nothing runs on it after the prelude
+} Snapshot;
 
-void InitVM();
-void FreeVM();
-InterpretResult Interpret(const char* source);
-void Push(Value value);
-Value Pop();
+// Prints the prelude's errors and frees everything again if there are any.
+InterpretResult TakeSnapshot(Snapshot* snapshot, const char* prelude);
+// Only once the clones are freed.
+void FreeSnapshot(Snapshot* snapshot);
+void InitVMFromSnapshot(VM* vm, const Snapshot* snapshot);
+void Push(VM* vm, Value value);
+Value Pop(VM* vm);
 
 #endif
@@ -0,0 +1,182 @@
+#include "workers.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static bool InitJobQueue(JobQueue* queue, size_t capacity)
+{
+	size_t size = 2;
+	while (size < capacity) size *= 2;
+
+	queue->slots = (JobSlot*)malloc(sizeof(JobSlot) * size);
+	if (queue->slots == NULL) return false;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		atomic_init(&queue->slots[i].sequence, i);
+		queue->slots[i].job = NULL;
+	}
+	queue->mask = size - 1;
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+	return true;
+}
+
+/*
+	A slot at position p is free to push to once its sequence is p, and holds a job to pop once it is p + 1. The
+	pop sets it to p + capacity, which frees the slot for the push one lap later. A thread claims a position by
+	moving 'head' or 'tail' past it, and publishes the slot by storing the sequence afterwards.
+*/
+
+static bool PushJob(JobQueue* queue, Job* job)
+{
+	size_t position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	while (true)
+	{
+		JobSlot* slot = &queue->slots[position & queue->mask];
+		size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+		intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+		if (difference == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&queue->head, &position, position + 1, memory_order_relaxed,
+				memory_order_relaxed))
+			{
+				slot->job = job;
+				atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+				return true;
+			}
+		}
+		else if (difference < 0)
+		{
+			return false; // the slot still holds a job from the previous lap
+		}
+		else
+		{
+			position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+		}
+	}
+}
+
+static Job* PopJob(JobQueue* queue)
+{
+	size_t position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	while (true)
+	{
+		JobSlot* slot = &queue->slots[position & queue->mask];
+		size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+		intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+
+		if (difference == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&queue->tail, &position, position + 1, memory_order_relaxed,
+				memory_order_relaxed))
+			{
+				Job* job = slot->job;
+				atomic_store_explicit(&slot->sequence, position + queue->mask + 1, memory_order_release);
+				return job;
+			}
+		}
+		else if (difference < 0)
+		{
+			return NULL; // nothing pushed to the slot yet
+		}
+		else
+		{
+			position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+		}
+	}
+}
+
+// Every job pushed has been popped. Only meaningful once no more jobs are being pushed.
+static bool IsDrained(JobQueue* queue)
+{
+	return atomic_load_explicit(&queue->tail, memory_order_acquire) == 
+		atomic_load_explicit(&queue->head, memory_order_acquire);
+}
+
+static int RunWorker(void* argument)
+{
+	Worker* worker = (Worker*)argument;
+	WorkerPool* pool = worker->pool;
+
+	while (true)
+	{
+		Job* job = PopJob(&pool->queue);
+		if (job == NULL)
+		{
+			// The pop can miss a job pushed right before the pool was told to stop, it read the slot before the 
+			// flag. Jobs are all pushed by then, so the worker keeps popping until the queue is drained.
+			if (atomic_load_explicit(&pool->stopping, memory_order_acquire) && IsDrained(&pool->queue)) return 0;
+			thrd_yield();
+			continue;
+		}
+
+		job->result = RunProgram(&worker->vm, pool->program);
+		// Releases the job's result to WaitForJobs().
+		atomic_fetch_add_explicit(&pool->finished, 1, memory_order_release);
+	}
+}
+
+bool InitWorkerPool(WorkerPool* pool, const Program* program, int workerCount, size_t queueCapacity)
+{
+	if (!InitJobQueue(&pool->queue, queueCapacity)) return false;
+	pool->program = program;
+	pool->workerCount = workerCount;
+	atomic_init(&pool->stopping, false);
+	atomic_init(&pool->finished, 0);
+	pool->submitted = 0;
+
+	pool->workers = (Worker*)malloc(sizeof(Worker) * workerCount);
+	if (pool->workers == NULL)
+	{
+		free(pool->queue.slots);
+		return false;
+	}
+
+	for (int i = 0; i < workerCount; i++)
+	{
+		pool->workers[i].pool = pool;
+		InitProgramVM(&pool->workers[i].vm, program);
+	}
+	for (int i = 0; i < workerCount; i++)
+	{
+		if (thrd_create(&pool->workers[i].thread, RunWorker, &pool->workers[i]) != thrd_success)
+		{
+			// The workers that did start are stopped again by FreeWorkerPool(), the rest never ran.
+			for (int j = i; j < workerCount; j++) FreeVM(&pool->workers[j].vm);
+			pool->workerCount = i;
+			FreeWorkerPool(pool);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool SubmitJob(WorkerPool* pool, Job* job)
+{
+	if (!PushJob(&pool->queue, job)) return false;
+	pool->submitted++;
+	return true;
+}
+
+void WaitForJobs(WorkerPool* pool)
+{
+	while (atomic_load_explicit(&pool->finished, memory_order_acquire) != pool->submitted) thrd_yield();
+}
+
+void FreeWorkerPool(WorkerPool* pool)
+{
+	atomic_store_explicit(&pool->stopping, true, memory_order_release);
+	for (int i = 0; i < pool->workerCount; i++)
+	{
+		thrd_join(pool->workers[i].thread, NULL);
+		FreeVM(&pool->workers[i].vm);
+	}
+
+	free(pool->workers);
+	free(pool->queue.slots);
+	pool->workers = NULL;
+	pool->workerCount = 0;
+}
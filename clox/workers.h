@@ -0,0 +1,65 @@
+#ifndef clox_workers_h
+#define clox_workers_h
+
+#include "common.h"
+#include "vm.h"
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+// One run of the pool's program. 'result' can be read once WaitForJobs() returns.
+typedef struct
+{
+	InterpretResult result;
+} Job;
+
+typedef struct
+{
+	atomic_size_t sequence; // tells pushes and pops whether the slot is theirs in the current lap
+	Job* job;
+} JobSlot;
+
+// Bounded lock-free queue any number of threads can push to and pop from. Pushes only compete with each other
+// for 'head' and pops for 'tail', a slot's sequence number hands it from the pushing thread to the popping one.
+typedef struct
+{
+	JobSlot* slots;
+	size_t mask; // capacity - 1, the capacity is a power of two
+	alignas(CACHE_LINE) atomic_size_t head; // next slot to push to
+	alignas(CACHE_LINE) atomic_size_t tail; // next slot to pop from
+} JobQueue;
+
+typedef struct
+{
+	VM vm;
+	thrd_t thread;
+	struct WorkerPool* pool;
+} Worker;
+
+// Threads that each own a VM and run jobs of one shared program. Idle workers spin on the queue, yielding their
+// time slice, so a pool is meant to be kept busy rather than kept around.
+// A pool only runs the program it was made for, its VMs can't run another, see InitProgramVM(). Different scripts 
+// need a pool each.
+typedef struct WorkerPool
+{
+	JobQueue queue;
+	const Program* program;
+	Worker* workers;
+	int workerCount;
+	atomic_bool stopping;
+	alignas(CACHE_LINE) atomic_size_t finished; // jobs run so far
+	size_t submitted; // only touched by the thread submitting jobs
+} WorkerPool;
+
+// 'queueCapacity' is rounded up to a power of two. The program has to outlive the pool. Returns false, with 
+// nothing left to free, if the queue or the workers can't be allocated or a thread can't be started.
+bool InitWorkerPool(WorkerPool* pool, const Program* program, int workerCount, size_t queueCapacity);
+// Returns false if the queue is full. 'job' must stay put until WaitForJobs() returns.
+bool SubmitJob(WorkerPool* pool, Job* job);
+// Waits until every submitted job has run. Only for the thread that submits them.
+void WaitForJobs(WorkerPool* pool);
+// Runs the jobs still queued, then stops the threads and frees their VMs.
+void FreeWorkerPool(WorkerPool* pool);
+
+#endif // !clox_workers_h